@@ -17,6 +17,10 @@
   reference is set to the actual persistent object that map to the database records of the network data being
   processed. The proxy functions are using these references to invoke Java methods.
 
+  Alternatively, the records can be written natively into an SQLite database without starting a JVM at all (-s sqlite).
+  The SQLite database has the same schema as the H2 one. In this case, the persistentobject structs hold the ids of
+  the rows currently processed instead of entity objects and the proxy functions execute prepared statements.
+
 */
 
 
@@ -25,8 +29,10 @@
 #include <netinet/ip.h>
 #include <netinet/in.h>
 #include <netinet/in_systm.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
@@ -36,13 +42,27 @@
 #include <unistd.h>
 #include <time.h>
 #include <limits.h>
-
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <dlfcn.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TAG_SIMD
+#endif
+
+#include "pcap.h"
 #include "nids.h"
 #include "jni.h"
+#include "sqlite3.h"
 
 
 #define logf(fmt, ...) fprintf(stderr, "[%lu] %s:%u: %s: " fmt "\n", (unsigned long) time(NULL), __FILE__, __LINE__, __func__, __VA_ARGS__)
 #define log(s) logf("%s", s)
+/* messages about single packets, flows and connections, only with -v. The arguments are not evaluated otherwise, so
+   nothing is formatted for them. */
+#define debugf(fmt, ...) do { if (verbose) { logf(fmt, __VA_ARGS__); } } while (0)
 
 #define die(s)					\
   log("FATAL: " s);				\
@@ -58,12 +78,32 @@
     exit(EXIT_FAILURE);				\
   }
 
+/* Same for SQLite errors, on the connection of the current partition or on handle. */
+#define q(res) qdb(db, res)
+#define qdb(handle, res)						\
+  if ((res) != SQLITE_OK && (res) != SQLITE_ROW && (res) != SQLITE_DONE) { \
+    logf("FATAL: sqlite error: %s", sqlite3_errmsg(handle));		\
+    exit(EXIT_FAILURE);							\
+  }
+
 #define int_ntoa(x) inet_ntoa(*((struct in_addr *)&x))
 
-#define usage()								      \
-  fprintf(stderr, "usage: %s -d <working directory> <pcap file>\n", argv[0]); \
+#define timeset(ts) ((ts)->tv_sec != 0 || (ts)->tv_usec != 0)
+
+#define usage()								\
+  fprintf(stderr, "usage: %s -d <working directory> [-s h2|sqlite] [-z none|zip|tgz] [-t <flow timeout>]\n" \
+	  "        [-f <bpf filter>] [-c <proto>[/<port>]:<bytes>]... [-r <sample rate>] [-k <packets>]\n" \
+	  "        [-p <partition interval>] [-S <statistics file>] [-g]\n" \
+	  "        [-T <tag patterns file>] [-D <duplicate window>] [-v] <pcap file>\n", argv[0]); \
   exit(EXIT_FAILURE);
 
+/* name of the database in the working directory, the database files of partitions are named DBNAME_<start> */
+#define DBNAME "db"
+/* name of the SQLite database file in the working directory */
+#define SQLITE_DBNAME DBNAME ".sqlite"
+/* number of writes to the SQLite database per transaction */
+#define SQLITE_BATCH 4096
+
 #define hexdump(offset, len)			\
   FILE *hexdump = popen("hexdump -C >&2", "w");	\
   fwrite(offset, 1, len, hexdump);		\
@@ -74,7 +114,53 @@ struct jobjectholder {
   jobject object;
 };
 
-typedef struct jobjectholder persistentobject;
+/* The record currently being processed, either as an entity object (H2) or as row ids (SQLite). */
+struct persistentobject {
+  jclass class;
+  jobject object;
+  int id;
+  int streamId; // Udp4Stream
+  int outStreamId; // Tcp4Connection
+  int inStreamId; // Tcp4Connection
+};
+
+typedef struct persistentobject persistentobject;
+
+/* Counters of a flow or TCP connection, written to FlowSummary when it is finished. out is the only direction of
+   UDP and raw IP flows. */
+struct counters {
+  struct timeval firstTime;
+  struct timeval lastTime; // of the last packet
+  long outPackets;
+  long outBytes; // payload
+  long inPackets;
+  long inBytes;
+};
+
+/* A database holding the flows started within one partitioninterval, or the only database. With SQLite, each one has
+   a connection and prepared statements of its own. */
+struct partition {
+  struct partition *next; // open partitions, newest first
+  int index; // start / partitioninterval
+  char name[32]; // DBNAME_YYYYMMDDTHHMMSS or DBNAME
+  time_t start;
+  struct timeval startTime; // earlier than start if flows out of order were added
+  int refs; // flows and connections stored in it still active
+  sqlite3 *db;
+  sqlite3_stmt **stmts;
+};
+
+enum sinks {
+  SINK_H2,
+  SINK_SQLITE
+};
+
+/* backup of the H2 database when closing it, must match the BACKUP_* constants of Util */
+enum backups {
+  BACKUP_NONE = 0,
+  BACKUP_ZIP = 1,
+  BACKUP_TGZ = 2
+};
 
 /* tuple for indentifiying a unique Ip4Stream record: source address, destination address, protocol */
 struct tuple3 {
@@ -84,12 +170,39 @@ struct tuple3 {
 };
 
 
+/* libjvm.so is only loaded when the H2 sink is used, so pcap2sql runs without a JDK with -s sqlite */
+#ifndef LIBJVM
+#define LIBJVM "libjvm.so"
+#endif
+
+typedef jint (JNICALL *createjavavm)(JavaVM **, void **, void *);
+
+
 /* globals */
 JavaVM *jvm;
 JNIEnv *jni;
 
 char inputfile[PATH_MAX];
 char workdir[PATH_MAX];
+int verbose = 0;
+
+enum sinks sink = SINK_H2;
+enum backups backup = BACKUP_ZIP;
+
+/* seconds covered by each partition, 0 means a single database */
+long partitioninterval = 0;
+struct partition *partitions = NULL;
+/* the partition the proxy functions work on */
+struct partition *partition = NULL;
+
+/* highest ids handed out so far, they are unique over all partitions */
+int lastIp4StreamId = 0;
+int lastTcp4ConnectionId = 0;
+int lastUdp4StreamId = 0;
+
+/* SQLite connection of the current partition and of the catalog of the partitions */
+sqlite3 *db;
+sqlite3 *catalog = NULL;
 
 persistentobject Ip4Stream;
 persistentobject Tcp4Connection;
@@ -106,6 +219,21 @@ int jvm_start(char *classpath) {
   int res;
   char *buf_opt_classpath;
   int i;
+  void *libjvm;
+  createjavavm create;
+
+  /* loaded only now, the SQLite sink does not depend on it */
+  logf("loading %s", LIBJVM);
+  libjvm = dlopen(LIBJVM, RTLD_NOW | RTLD_GLOBAL);
+  if (libjvm == NULL) {
+    logf("failed to load the jvm: %s", dlerror());
+    return JNI_ERR;
+  }
+  create = (createjavavm) dlsym(libjvm, "JNI_CreateJavaVM");
+  if (create == NULL) {
+    logf("JNI_CreateJavaVM() not found: %s", dlerror());
+    return JNI_ERR;
+  }
 
   /* set the class path */
   buf_opt_classpath = malloc(4096);
@@ -128,7 +256,7 @@ int jvm_start(char *classpath) {
   }
 
   log("starting the jvm");
-  res = (int) JNI_CreateJavaVM(&jvm, (void **)&jni, &vmargs);
+  res = (int) create(&jvm, (void **)&jni, &vmargs);
   logf("JNI_CreateJavaVM() returned %d, returning it", res);
   free(buf_opt_classpath);
   return res;
@@ -143,6 +271,35 @@ int jvm_shutdown() {
   return res;
 }
 
+/* returns the bytes currently used on the JVM heap */
+long jvm_heapused() {
+  jclass clazz;
+  jmethodID method;
+  jobject runtime;
+  jlong total, free;
+
+  clazz = (*jni)->FindClass(jni, "java/lang/Runtime");
+  e();
+  method = (*jni)->GetStaticMethodID(jni, clazz, "getRuntime", "()Ljava/lang/Runtime;");
+  e();
+  runtime = (*jni)->CallStaticObjectMethod(jni, clazz, method);
+  e();
+  method = (*jni)->GetMethodID(jni, clazz, "totalMemory", "()J");
+  e();
+  total = (*jni)->CallLongMethod(jni, runtime, method);
+  e();
+  method = (*jni)->GetMethodID(jni, clazz, "freeMemory", "()J");
+  e();
+  free = (*jni)->CallLongMethod(jni, runtime, method);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, runtime);
+  (*jni)->DeleteLocalRef(jni, clazz);
+
+  return (long) (total - free);
+}
+
 /* initialize global class pointers */
 void init_jobjectholders() {
   Ip4Stream.class = (*jni)->FindClass(jni, "pcap2sql/orm/Ip4Stream");
@@ -156,13 +313,19 @@ void init_jobjectholders() {
   return;
 }
 
+/* returns the path of a stream file, valid until the next call. The part before the id is only copied on the first
+   call, the working directory does not change after the command line is read. */
 const char *to_streamfile_path(int id) {
   static char path[PATH_MAX];
-  char buf[64];
-  strncpy(path, workdir, PATH_MAX - 64);
-  sprintf(buf, "/stream_%d", id);
-  strcat(path, buf);
-  return (const char *) &path;
+  static size_t prefixlen = 0;
+
+  if (prefixlen == 0) {
+    strncpy(path, workdir, PATH_MAX - 64);
+    strcat(path, "/stream_");
+    prefixlen = strlen(path);
+  }
+  sprintf(path + prefixlen, "%d", id);
+  return path;
 }
 
 const char *to_tuple4string(struct tuple4 addr)
@@ -186,8 +349,9 @@ const char *to_tuple3string(struct tuple3 t3)
 
 /* converts struct timeval to java.sql.Timestamp */
 jobject to_Timestamp(struct timeval *ts) {
-  jclass clazz;
-  jmethodID method;
+  static jclass clazz = NULL;
+  static jmethodID init, setNanos;
+  jclass local;
   jobject object;
   
   /* tv_sec holds the seconds elapsed since the epoch.  */
@@ -197,20 +361,24 @@ jobject to_Timestamp(struct timeval *ts) {
   /* It must be converted as Timestamp has a fractional part in nanoseconds precision. */
   jint timeFrac = ts->tv_usec * 1000;
 
-  clazz = (*jni)->FindClass(jni, "java/sql/Timestamp");
-  e();
-  method = (*jni)->GetMethodID(jni, clazz, "<init>", "(J)V");
-  e();
-  object = (*jni)->NewObject(jni, clazz, method, timeInt);
-  e();
-  method = (*jni)->GetMethodID(jni, clazz, "setNanos", "(I)V");
+  /* looked up once, the class is held by a global reference */
+  if (clazz == NULL) {
+    local = (*jni)->FindClass(jni, "java/sql/Timestamp");
+    e();
+    clazz = (*jni)->NewGlobalRef(jni, local);
+    e();
+    (*jni)->DeleteLocalRef(jni, local);
+    init = (*jni)->GetMethodID(jni, clazz, "<init>", "(J)V");
+    e();
+    setNanos = (*jni)->GetMethodID(jni, clazz, "setNanos", "(I)V");
+    e();
+  }
+
+  object = (*jni)->NewObject(jni, clazz, init, timeInt);
   e();
-  (*jni)->CallVoidMethod(jni, object, method, timeFrac);
+  (*jni)->CallVoidMethod(jni, object, setNanos, timeFrac);
   e();
 
-  /* delete local references explicitly */
-  (*jni)->DeleteLocalRef(jni, clazz);
-
   return object;
 }
 
@@ -220,10 +388,499 @@ int open_streamfile(int streamId) {
     logf("failed to open %s for writing: %s", to_streamfile_path(streamId), strerror(errno));
     return fd;
   }
-  logf("opened %s for writing", to_streamfile_path(streamId));
+  debugf("opened %s for writing", to_streamfile_path(streamId));
   return fd;
 }
 
+/* creates an empty stream file for a new stream, dropping whatever a rolled back run may have left behind */
+void create_streamfile(int streamId) {
+  int fd = open(to_streamfile_path(streamId), O_CREAT | O_WRONLY | O_TRUNC, 0644);
+  if (fd == -1) {
+    logf("failed to create %s: %s", to_streamfile_path(streamId), strerror(errno));
+    return;
+  }
+  close(fd);
+}
+
+/* stream files held open by TCP connections, limited to stay clear of RLIMIT_NOFILE */
+long spoolfds = 0;
+long maxspoolfds = 0;
+long peakspoolfds = 0;
+
+/* appends len bytes to the stream file, returns the number of bytes written or -1. If held is not NULL, the file
+   descriptor is kept open there for the next call (-1 if there is none yet) as long as maxspoolfds allows it. */
+int spool(int *held, int streamId, const void *data, int len) {
+  int fd, res;
+
+  /* nothing to write (e.g. payload cap reached), don't even open the file */
+  if (len == 0) {
+    return 0;
+  }
+
+  if (held != NULL && *held != -1) {
+    fd = *held;
+  } else {
+    fd = open_streamfile(streamId);
+    if (fd == -1) {
+      return -1;
+    }
+  }
+  res = write(fd, data, len);
+  if (res == -1) {
+    logf("failed to write to %s: %s", to_streamfile_path(streamId), strerror(errno));
+  }
+  if (held != NULL && *held == -1 && spoolfds < maxspoolfds) {
+    *held = fd;
+    if (++spoolfds > peakspoolfds) {
+      peakspoolfds = spoolfds;
+    }
+  } else if (held == NULL || *held != fd) {
+    close(fd);
+  }
+  return res;
+}
+
+/* closes a stream file held open by spool() */
+void spool_close(int *held) {
+  if (*held != -1) {
+    close(*held);
+    *held = -1;
+    spoolfds--;
+  }
+}
+
+/* SQLite sink */
+
+/* prepared statements, indexed by enum statements */
+enum statements {
+  INSERT_IP4STREAM,
+  SET_IP4STREAM_LASTTIME,
+  SET_IP4STREAM_DATA,
+  INSERT_TCP4CONNECTION,
+  FIND_TCP4CONNECTION,
+  SET_TCP4CONNECTION_LASTTIME,
+  SET_TCP4CONNECTION_FINALSTATUS,
+  INSERT_UDP4STREAM,
+  INSERT_STREAMSEGMENT,
+  INSERT_FLOWSUMMARY,
+  INSERT_HTTPREQUEST,
+  INSERT_TLSCLIENTHELLO,
+  INSERT_DNSRECORD,
+  INSERT_PAYLOADGRAM,
+  INSERT_PAYLOADTAG,
+  N_STATEMENTS
+};
+
+const char *sql_schema =
+  "CREATE TABLE IF NOT EXISTS Ip4Stream (id INTEGER PRIMARY KEY, destIp VARCHAR(15), sourceIp VARCHAR(15), proto INTEGER, "
+  "firstTime TIMESTAMP, lastTime TIMESTAMP, data BLOB);"
+  "CREATE TABLE IF NOT EXISTS Tcp4Connection (id INTEGER PRIMARY KEY, destPort INTEGER, sourcePort INTEGER, "
+  "lastTime TIMESTAMP, finalStatus INTEGER, outStreamId INTEGER REFERENCES Ip4Stream (id), "
+  "inStreamId INTEGER REFERENCES Ip4Stream (id), incoming BOOLEAN);"
+  "CREATE TABLE IF NOT EXISTS Udp4Stream (id INTEGER PRIMARY KEY, destPort INTEGER, sourcePort INTEGER, "
+  "streamId INTEGER REFERENCES Ip4Stream (id));"
+  "CREATE TABLE IF NOT EXISTS StreamSegment (streamId INTEGER REFERENCES Ip4Stream (id), number BIGINT, "
+  "\"offset\" BIGINT, length BIGINT, time TIMESTAMP);"
+  "CREATE INDEX IF NOT EXISTS Ip4Stream_tuple3 ON Ip4Stream (destIp, sourceIp, proto);"
+  "CREATE TABLE IF NOT EXISTS FlowSummary (streamId INTEGER PRIMARY KEY REFERENCES Ip4Stream (id), proto INTEGER, "
+  "flowId INTEGER, inStreamId INTEGER REFERENCES Ip4Stream (id), firstTime TIMESTAMP, lastTime TIMESTAMP, "
+  "duration DOUBLE, outPackets BIGINT, outBytes BIGINT, inPackets BIGINT, inBytes BIGINT, meanInterArrival DOUBLE, "
+  "finalStatus INTEGER);"
+  "CREATE INDEX IF NOT EXISTS StreamSegment_streamId ON StreamSegment (streamId, number);"
+  "CREATE INDEX IF NOT EXISTS FlowSummary_flow ON FlowSummary (proto, flowId);"
+  "CREATE INDEX IF NOT EXISTS FlowSummary_firstTime ON FlowSummary (firstTime);"
+  "CREATE TABLE IF NOT EXISTS HttpRequest (streamId INTEGER REFERENCES Ip4Stream (id), segment BIGINT, number INTEGER, "
+  "time TIMESTAMP, method VARCHAR(16), uri VARCHAR(2048), version VARCHAR(16), host VARCHAR(256), "
+  "userAgent VARCHAR(512), PRIMARY KEY (streamId, segment, number));"
+  "CREATE TABLE IF NOT EXISTS TlsClientHello (streamId INTEGER REFERENCES Ip4Stream (id), segment BIGINT, "
+  "number INTEGER, time TIMESTAMP, version INTEGER, serverName VARCHAR(256), PRIMARY KEY (streamId, segment, number));"
+  "CREATE TABLE IF NOT EXISTS DnsRecord (streamId INTEGER REFERENCES Ip4Stream (id), segment BIGINT, number INTEGER, "
+  "time TIMESTAMP, transactionId INTEGER, response BOOLEAN, rcode INTEGER, section INTEGER, name VARCHAR(256), "
+  "type INTEGER, data VARCHAR(256), PRIMARY KEY (streamId, segment, number));"
+  "CREATE INDEX IF NOT EXISTS HttpRequest_host ON HttpRequest (host);"
+  "CREATE INDEX IF NOT EXISTS TlsClientHello_serverName ON TlsClientHello (serverName);"
+  "CREATE INDEX IF NOT EXISTS DnsRecord_name ON DnsRecord (name);"
+  "CREATE TABLE IF NOT EXISTS PayloadGram (gram BLOB, streamId INTEGER REFERENCES Ip4Stream (id), "
+  "PRIMARY KEY (gram, streamId)) WITHOUT ROWID;"
+  "CREATE TABLE IF NOT EXISTS PayloadTag (streamId INTEGER REFERENCES Ip4Stream (id), segment BIGINT, pattern INTEGER, "
+  "\"offset\" BIGINT);"
+  "CREATE INDEX IF NOT EXISTS PayloadTag_pattern ON PayloadTag (pattern);"
+  "CREATE INDEX IF NOT EXISTS PayloadTag_streamId ON PayloadTag (streamId, segment);";
+
+const char *sql_catalog_schema =
+  "CREATE TABLE IF NOT EXISTS TimePartition (name VARCHAR(32) PRIMARY KEY, startTime TIMESTAMP, endTime TIMESTAMP);";
+
+/* the ids are set explicitly, so that they are unique over all partitions */
+const char *sql_statements[N_STATEMENTS] = {
+  [INSERT_IP4STREAM] = "INSERT INTO Ip4Stream (id, destIp, sourceIp, proto, firstTime) VALUES (?5, ?1, ?2, ?3, ?4)",
+  [SET_IP4STREAM_LASTTIME] = "UPDATE Ip4Stream SET lastTime = ?2 WHERE id = ?1",
+  [SET_IP4STREAM_DATA] = "UPDATE Ip4Stream SET data = ?2 WHERE id = ?1",
+  [INSERT_TCP4CONNECTION] = "INSERT INTO Tcp4Connection (id, destPort, sourcePort, finalStatus, outStreamId, inStreamId, "
+                            "incoming) VALUES (?5, ?1, ?2, 0, ?3, ?4, 0)",
+  [FIND_TCP4CONNECTION] = "SELECT outStreamId, inStreamId FROM Tcp4Connection WHERE id = ?1",
+  [SET_TCP4CONNECTION_LASTTIME] = "UPDATE Tcp4Connection SET lastTime = ?2 WHERE id = ?1",
+  [SET_TCP4CONNECTION_FINALSTATUS] = "UPDATE Tcp4Connection SET finalStatus = ?2 WHERE id = ?1",
+  [INSERT_UDP4STREAM] = "INSERT INTO Udp4Stream (id, destPort, sourcePort, streamId) VALUES (?4, ?1, ?2, ?3)",
+  [INSERT_STREAMSEGMENT] = "INSERT INTO StreamSegment (streamId, number, \"offset\", length, time) VALUES (?1, ?2, ?3, ?4, ?5)",
+  [INSERT_FLOWSUMMARY] = "INSERT INTO FlowSummary VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, ?13)",
+  [INSERT_HTTPREQUEST] = "INSERT INTO HttpRequest VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9)",
+  [INSERT_TLSCLIENTHELLO] = "INSERT INTO TlsClientHello VALUES (?1, ?2, ?3, ?4, ?5, ?6)",
+  [INSERT_DNSRECORD] = "INSERT INTO DnsRecord VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11)",
+  [INSERT_PAYLOADGRAM] = "INSERT OR IGNORE INTO PayloadGram VALUES (?2, ?1)",
+  [INSERT_PAYLOADTAG] = "INSERT INTO PayloadTag VALUES (?1, ?2, ?3, ?4)"
+};
+
+sqlite3_stmt **sql_stmts; // of the current partition
+int sql_writes = 0; // writes in the current transactions
+
+/* converts struct timeval to the text representation of an SQL timestamp (UTC), valid until the next call. The date
+   and time are only formatted again when the second changes. */
+const char *to_timestring(struct timeval *ts) {
+  static char buf[32];
+  static time_t formatted = -1;
+  static size_t len;
+  time_t sec = ts->tv_sec;
+  struct tm tm;
+
+  if (sec != formatted) {
+    gmtime_r(&sec, &tm);
+    len = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm);
+    formatted = sec;
+  }
+  sprintf(buf + len, ".%06ld", (long) ts->tv_usec);
+  return buf;
+}
+
+/* opens the catalog of the partitions, without partitioning all is in the database of the only partition */
+void sql_open() {
+  char path[PATH_MAX];
+  int res;
+
+  if (partitioninterval == 0) {
+    return;
+  }
+
+  strcpy(path, workdir); // workdir is at most PATH_MAX - 64 long
+  strcat(path, "/" SQLITE_DBNAME);
+  logf("opening the catalog %s", path);
+  res = sqlite3_open(path, &catalog);
+  qdb(catalog, res);
+  res = sqlite3_exec(catalog, sql_catalog_schema, NULL, NULL, NULL);
+  qdb(catalog, res);
+}
+
+void sql_close() {
+  int res;
+
+  if (catalog != NULL) {
+    res = sqlite3_close(catalog);
+    qdb(catalog, res);
+  }
+  log("sqlite database closed");
+}
+
+/* raises *last to the highest id in the table, so that new ids don't collide with ones left by an earlier run */
+void sql_maxid(sqlite3 *handle, const char *table, int *last) {
+  sqlite3_stmt *s;
+  char sql[64];
+  int res;
+
+  sprintf(sql, "SELECT max(id) FROM %s", table);
+  res = sqlite3_prepare_v2(handle, sql, -1, &s, NULL);
+  qdb(handle, res);
+  res = sqlite3_step(s);
+  qdb(handle, res);
+  if (res == SQLITE_ROW && sqlite3_column_int(s, 0) > *last) {
+    *last = sqlite3_column_int(s, 0);
+  }
+  sqlite3_finalize(s);
+}
+
+void sql_openPartition(struct partition *p) {
+  char path[PATH_MAX];
+  struct timeval end = {p->start + partitioninterval, 0};
+  char *sql;
+  int res, i;
+
+  strcpy(path, workdir); // workdir is at most PATH_MAX - 64 long
+  strcat(path, "/");
+  strcat(path, p->name);
+  strcat(path, ".sqlite");
+  logf("opening %s", path);
+  res = sqlite3_open(path, &p->db);
+  qdb(p->db, res);
+
+  /* the working files are the real spool, losing the last transaction on power failure is acceptable */
+  res = sqlite3_exec(p->db, "PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;", NULL, NULL, NULL);
+  qdb(p->db, res);
+  res = sqlite3_exec(p->db, sql_schema, NULL, NULL, NULL);
+  qdb(p->db, res);
+
+  p->stmts = calloc(N_STATEMENTS, sizeof(sqlite3_stmt *));
+  if (p->stmts == NULL) {
+    die("out of memory");
+  }
+  for (i = 0; i < N_STATEMENTS; i++) {
+    res = sqlite3_prepare_v2(p->db, sql_statements[i], -1, &p->stmts[i], NULL);
+    qdb(p->db, res);
+  }
+
+  sql_maxid(p->db, "Ip4Stream", &lastIp4StreamId);
+  sql_maxid(p->db, "Tcp4Connection", &lastTcp4ConnectionId);
+  sql_maxid(p->db, "Udp4Stream", &lastUdp4StreamId);
+
+  res = sqlite3_exec(p->db, "BEGIN", NULL, NULL, NULL);
+  qdb(p->db, res);
+
+  if (catalog != NULL) {
+    sql = sqlite3_mprintf("INSERT OR REPLACE INTO TimePartition VALUES (%Q, %Q, ", p->name, to_timestring(&p->startTime));
+    sql = sqlite3_mprintf("%z%Q)", sql, to_timestring(&end));
+    res = sqlite3_exec(catalog, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    qdb(catalog, res);
+  }
+}
+
+void sql_closePartition(struct partition *p) {
+  char *sql;
+  int res, i;
+
+  res = sqlite3_exec(p->db, "COMMIT", NULL, NULL, NULL);
+  qdb(p->db, res);
+
+  for (i = 0; i < N_STATEMENTS; i++) {
+    sqlite3_finalize(p->stmts[i]);
+  }
+  free(p->stmts);
+
+  /* fold the WAL back into the database file, so that the output is a single file */
+  res = sqlite3_wal_checkpoint_v2(p->db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+  qdb(p->db, res);
+  res = sqlite3_close(p->db);
+  qdb(p->db, res);
+
+  if (catalog != NULL) {
+    sql = sqlite3_mprintf("UPDATE TimePartition SET startTime = %Q WHERE name = %Q", to_timestring(&p->startTime), p->name);
+    res = sqlite3_exec(catalog, sql, NULL, NULL, NULL);
+    sqlite3_free(sql);
+    qdb(catalog, res);
+  }
+  logf("%s closed", p->name);
+}
+
+/* deletes the partitions created after a checkpoint, whose names sort after name */
+void sql_dropPartitionsAfter(const char *name) {
+  sqlite3_stmt *s;
+  char path[PATH_MAX];
+  char *sql;
+  int res;
+
+  sql = sqlite3_mprintf("SELECT name FROM TimePartition WHERE name > %Q", name);
+  res = sqlite3_prepare_v2(catalog, sql, -1, &s, NULL);
+  sqlite3_free(sql);
+  qdb(catalog, res);
+  while ((res = sqlite3_step(s)) == SQLITE_ROW) {
+    strcpy(path, workdir); // workdir is at most PATH_MAX - 64 long
+    strcat(path, "/");
+    strncat(path, (const char *) sqlite3_column_text(s, 0), 31);
+    strcat(path, ".sqlite");
+    logf("deleting %s", path);
+    unlink(path);
+    strcat(path, "-wal");
+    unlink(path);
+    strcpy(path + strlen(path) - 4, "-shm");
+    unlink(path);
+  }
+  qdb(catalog, res);
+  sqlite3_finalize(s);
+
+  sql = sqlite3_mprintf("DELETE FROM TimePartition WHERE name > %Q", name);
+  res = sqlite3_exec(catalog, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  qdb(catalog, res);
+}
+
+/* commits the current transactions of all open partitions */
+void sql_commit() {
+  struct partition *p;
+  int res;
+
+  for (p = partitions; p != NULL; p = p->next) {
+    res = sqlite3_exec(p->db, "COMMIT; BEGIN", NULL, NULL, NULL);
+    qdb(p->db, res);
+  }
+  sql_writes = 0;
+}
+
+/* executes a prepared statement not returning rows, the transactions are committed every SQLITE_BATCH writes */
+void sql_exec(enum statements stmt) {
+  int res;
+
+  res = sqlite3_step(sql_stmts[stmt]);
+  q(res);
+  sqlite3_reset(sql_stmts[stmt]);
+  sqlite3_clear_bindings(sql_stmts[stmt]);
+
+  if (++sql_writes >= SQLITE_BATCH) {
+    sql_commit();
+  }
+}
+
+/* steps a prepared query, returns 1 if a row is available, the caller must reset the statement after reading it */
+int sql_query(enum statements stmt) {
+  int res;
+
+  res = sqlite3_step(sql_stmts[stmt]);
+  q(res);
+  return res == SQLITE_ROW;
+}
+
+void sql_done(enum statements stmt) {
+  sqlite3_reset(sql_stmts[stmt]);
+  sqlite3_clear_bindings(sql_stmts[stmt]);
+}
+
+int sql_insertIp4Stream(u_int daddr, u_int saddr, int proto, struct timeval *ts) {
+  sqlite3_stmt *s = sql_stmts[INSERT_IP4STREAM];
+
+  sqlite3_bind_text(s, 1, int_ntoa(daddr), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(s, 2, int_ntoa(saddr), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int(s, 3, proto);
+  sqlite3_bind_text(s, 4, to_timestring(ts), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int(s, 5, ++lastIp4StreamId);
+  sql_exec(INSERT_IP4STREAM);
+  return lastIp4StreamId;
+}
+
+void sql_setLastTime(enum statements stmt, int id, struct timeval *ts) {
+  sqlite3_bind_int(sql_stmts[stmt], 1, id);
+  sqlite3_bind_text(sql_stmts[stmt], 2, to_timestring(ts), -1, SQLITE_TRANSIENT);
+  sql_exec(stmt);
+}
+
+/* number and offset are kept by the flow or connection, the previous segment is not looked up */
+void sql_addStreamSegment(int streamId, long number, long offset, int length, struct timeval *ts) {
+  sqlite3_stmt *s = sql_stmts[INSERT_STREAMSEGMENT];
+
+  sqlite3_bind_int(s, 1, streamId);
+  sqlite3_bind_int64(s, 2, number);
+  sqlite3_bind_int64(s, 3, offset);
+  sqlite3_bind_int(s, 4, length);
+  /* not copied by SQLite, the statement is executed before to_timestring() is called again */
+  sqlite3_bind_text(s, 5, to_timestring(ts), -1, SQLITE_STATIC);
+  sql_exec(INSERT_STREAMSEGMENT);
+}
+
+/* stores the stream file at path into Ip4Stream.data, the file is streamed into the blob in chunks. Streams longer
+   than the largest blob of the connection (SQLITE_MAX_LENGTH, 1e9 bytes by default) are truncated to it. */
+void sql_setData(int id, const char *path) {
+  sqlite3_blob *blob;
+  struct stat statbuf;
+  char buf[65536];
+  int fd, res;
+  ssize_t n = 0;
+  sqlite3_int64 size;
+  sqlite3_int64 offset = 0;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    logf("failed to open %s for reading: %s", path, strerror(errno));
+    return;
+  }
+  if (fstat(fd, &statbuf) == -1) {
+    logf("failed to stat %s: %s", path, strerror(errno));
+    close(fd);
+    return;
+  }
+
+  size = statbuf.st_size;
+  if (size > sqlite3_limit(db, SQLITE_LIMIT_LENGTH, -1)) {
+    size = sqlite3_limit(db, SQLITE_LIMIT_LENGTH, -1);
+    logf("%s has %lld bytes, storing only the first %lld", path, (long long) statbuf.st_size, (long long) size);
+  }
+
+  sqlite3_bind_int(sql_stmts[SET_IP4STREAM_DATA], 1, id);
+  res = sqlite3_bind_zeroblob64(sql_stmts[SET_IP4STREAM_DATA], 2, size);
+  if (res != SQLITE_OK) {
+    logf("failed to store %s: %s", path, sqlite3_errmsg(db));
+    sql_done(SET_IP4STREAM_DATA);
+    close(fd);
+    return;
+  }
+  sql_exec(SET_IP4STREAM_DATA);
+
+  res = sqlite3_blob_open(db, "main", "Ip4Stream", "data", id, 1, &blob);
+  q(res);
+  /* the blob is at most INT_MAX bytes, so are the offsets into it */
+  while (offset < size) {
+    n = read(fd, buf, size - offset < (sqlite3_int64) sizeof(buf) ? (size_t) (size - offset) : sizeof(buf));
+    if (n <= 0) {
+      break;
+    }
+    res = sqlite3_blob_write(blob, buf, (int) n, (int) offset);
+    q(res);
+    offset += n;
+  }
+  if (offset < size) {
+    logf("failed to read %s: %s", path, n == -1 ? strerror(errno) : "file shrank");
+  }
+  sqlite3_blob_close(blob);
+  close(fd);
+}
+
+
+/* removes all records created after a checkpoint from all open partitions, used when resuming */
+void sql_rollback(int maxIp4StreamId, int maxTcp4ConnectionId, int maxUdp4StreamId) {
+  struct partition *p;
+  char *sql;
+  int res;
+
+  sql = sqlite3_mprintf("DELETE FROM Tcp4Connection WHERE id > %d; DELETE FROM Udp4Stream WHERE id > %d; "
+			"DELETE FROM StreamSegment WHERE streamId > %d; DELETE FROM FlowSummary WHERE streamId > %d; "
+			"DELETE FROM HttpRequest WHERE streamId > %d; DELETE FROM TlsClientHello WHERE streamId > %d; "
+			"DELETE FROM DnsRecord WHERE streamId > %d; DELETE FROM PayloadGram WHERE streamId > %d; "
+			"DELETE FROM PayloadTag WHERE streamId > %d; DELETE FROM Ip4Stream WHERE id > %d;",
+			maxTcp4ConnectionId, maxUdp4StreamId, maxIp4StreamId, maxIp4StreamId, maxIp4StreamId, maxIp4StreamId,
+			maxIp4StreamId, maxIp4StreamId, maxIp4StreamId, maxIp4StreamId);
+  for (p = partitions; p != NULL; p = p->next) {
+    res = sqlite3_exec(p->db, sql, NULL, NULL, NULL);
+    qdb(p->db, res);
+  }
+  sqlite3_free(sql);
+}
+
+/* rolls a stream open at a checkpoint back, lastTime may be NULL */
+void sql_rollbackIp4Stream(int id, long segments, struct timeval *lastTime) {
+  char *sql;
+  int res;
+
+  sql = sqlite3_mprintf("DELETE FROM StreamSegment WHERE streamId = %d AND number > %ld; "
+			"DELETE FROM FlowSummary WHERE streamId = %d; "
+			"DELETE FROM HttpRequest WHERE streamId = %d AND segment > %ld; "
+			"DELETE FROM TlsClientHello WHERE streamId = %d AND segment > %ld; "
+			"DELETE FROM DnsRecord WHERE streamId = %d AND segment > %ld; "
+			"DELETE FROM PayloadGram WHERE streamId = %d; "
+			"DELETE FROM PayloadTag WHERE streamId = %d AND segment > %ld; "
+			"UPDATE Ip4Stream SET data = NULL, lastTime = %Q WHERE id = %d;",
+			id, segments, id, id, segments, id, segments, id, segments, id, id, segments,
+			lastTime != NULL ? to_timestring(lastTime) : NULL, id);
+  res = sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  q(res);
+}
+
+/* rolls a connection open at a checkpoint back, lastTime may be NULL */
+void sql_rollbackTcp4Connection(int id, struct timeval *lastTime) {
+  char *sql;
+  int res;
+
+  sql = sqlite3_mprintf("UPDATE Tcp4Connection SET finalStatus = 0, lastTime = %Q WHERE id = %d;",
+			lastTime != NULL ? to_timestring(lastTime) : NULL, id);
+  res = sqlite3_exec(db, sql, NULL, NULL, NULL);
+  sqlite3_free(sql);
+  q(res);
+}
+
 
 /* generic proxy functions mapping to common methods of Ip4Stream and other entity classes, they are not used directly  */
 
@@ -233,16 +890,19 @@ int _getId(persistentobject o) {
   return (int) (*jni)->CallIntMethod(jni, o.object, method);
 }
 
-void _addStreamSegment(persistentobject o, int length, struct timeval *ts) {
-  jmethodID method = (*jni)->GetMethodID(jni, o.class, "addStreamSegment", "(ILjava/sql/Timestamp;)V");
-  e();
-  jobject argTime = to_Timestamp(ts);
-  (*jni)->CallVoidMethod(jni, o.object, method, (jint) length, argTime);
+/* Called for each packet, so the time is passed as primitives instead of as a Timestamp object with a local
+   reference, and the method is looked up only once into *method. The number and offset of the segment are counted
+   here, the entity object would have to load the segments stored before to know them after resuming. */
+void _addStreamSegment(persistentobject o, const char *name, jmethodID *method, long number, long offset, int length,
+		       struct timeval *ts) {
+  if (*method == NULL) {
+    *method = (*jni)->GetMethodID(jni, o.class, name, "(JJIJI)V");
+    e();
+  }
+  (*jni)->CallVoidMethod(jni, o.object, *method, (jlong) number, (jlong) offset, (jint) length,
+			 (jlong) ts->tv_sec * 1000, (jint) ts->tv_usec * 1000);
   e();
 
-  /* delete local references explicitly */
-  (*jni)->DeleteLocalRef(jni, argTime);
-
   return;
 }
 
@@ -276,42 +936,76 @@ void _setData(persistentobject o, const char *path) {
 /* class specific proxy functions */
 
 int Ip4Stream_getId() {
+  if (sink == SINK_SQLITE) {
+    return Ip4Stream.id;
+  }
   return _getId(Ip4Stream);
 }
 
-void Ip4Stream_addStreamSegment(int length, struct timeval *ts) {
-  _addStreamSegment(Ip4Stream, length, ts);
+void Ip4Stream_addStreamSegment(long number, long offset, int length, struct timeval *ts) {
+  static jmethodID method = NULL;
+
+  if (sink == SINK_SQLITE) {
+    sql_addStreamSegment(Ip4Stream.id, number, offset, length, ts);
+    return;
+  }
+  _addStreamSegment(Ip4Stream, "addStreamSegment", &method, number, offset, length, ts);
 }
 
 void Ip4Stream_setLastTime(struct timeval *ts) {
+  if (sink == SINK_SQLITE) {
+    sql_setLastTime(SET_IP4STREAM_LASTTIME, Ip4Stream.id, ts);
+    return;
+  }
   _setLastTime(Ip4Stream, ts);
 }
 
 void Ip4Stream_setData(const char *path) {
+  if (sink == SINK_SQLITE) {
+    sql_setData(Ip4Stream.id, path);
+    return;
+  }
   _setData(Ip4Stream, path);
 }
 
 int Tcp4Connection_getId() {
+  if (sink == SINK_SQLITE) {
+    return Tcp4Connection.id;
+  }
   return _getId(Tcp4Connection);
 }
 
 int Tcp4Connection_getOutStreamId() {
+  if (sink == SINK_SQLITE) {
+    return Tcp4Connection.outStreamId;
+  }
   jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "getOutStreamId", "()I");
   e();
   return (int) (*jni)->CallIntMethod(jni, Tcp4Connection.object, method);
 }
 
 int Tcp4Connection_getInStreamId() {
+  if (sink == SINK_SQLITE) {
+    return Tcp4Connection.inStreamId;
+  }
   jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "getInStreamId", "()I");
   e();
   return (int) (*jni)->CallIntMethod(jni, Tcp4Connection.object, method);
 }
 
 void Tcp4Connection_setLastTime(struct timeval *ts) {
+  if (sink == SINK_SQLITE) {
+    sql_setLastTime(SET_TCP4CONNECTION_LASTTIME, Tcp4Connection.id, ts);
+    return;
+  }
   _setLastTime(Tcp4Connection, ts);
 }
 
 void Tcp4Connection_setOutStreamLastTime(struct timeval *ts) {
+  if (sink == SINK_SQLITE) {
+    sql_setLastTime(SET_IP4STREAM_LASTTIME, Tcp4Connection.outStreamId, ts);
+    return;
+  }
   jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "setOutStreamLastTime", "(Ljava/sql/Timestamp;)V");
   e();
   jobject argTime = to_Timestamp(ts);
@@ -325,6 +1019,10 @@ void Tcp4Connection_setOutStreamLastTime(struct timeval *ts) {
 }
 
 void Tcp4Connection_setInStreamLastTime(struct timeval *ts) {
+  if (sink == SINK_SQLITE) {
+    sql_setLastTime(SET_IP4STREAM_LASTTIME, Tcp4Connection.inStreamId, ts);
+    return;
+  }
   jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "setInStreamLastTime", "(Ljava/sql/Timestamp;)V");
   e();
   jobject argTime = to_Timestamp(ts);
@@ -337,33 +1035,31 @@ void Tcp4Connection_setInStreamLastTime(struct timeval *ts) {
   return;
 }
 
-void Tcp4Connection_addOutStreamSegment(int length, struct timeval *ts) {
-  jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "addOutStreamSegment", "(ILjava/sql/Timestamp;)V");
-  e();
-  jobject argTime = to_Timestamp(ts);
-  (*jni)->CallVoidMethod(jni, Tcp4Connection.object, method, (jint) length, argTime);
-  e();
-
-  /* delete local references explicitly */
-  (*jni)->DeleteLocalRef(jni, argTime);
+void Tcp4Connection_addOutStreamSegment(long number, long offset, int length, struct timeval *ts) {
+  static jmethodID method = NULL;
 
-  return;
+  if (sink == SINK_SQLITE) {
+    sql_addStreamSegment(Tcp4Connection.outStreamId, number, offset, length, ts);
+    return;
+  }
+  _addStreamSegment(Tcp4Connection, "addOutStreamSegment", &method, number, offset, length, ts);
 }
 
-void Tcp4Connection_addInStreamSegment(int length, struct timeval *ts) {
-  jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "addInStreamSegment", "(ILjava/sql/Timestamp;)V");
-  e();
-  jobject argTime = to_Timestamp(ts);
-  (*jni)->CallVoidMethod(jni, Tcp4Connection.object, method, (jint) length, argTime);
-  e();
-
-  /* delete local references explicitly */
-  (*jni)->DeleteLocalRef(jni, argTime);
+void Tcp4Connection_addInStreamSegment(long number, long offset, int length, struct timeval *ts) {
+  static jmethodID method = NULL;
 
-  return;
+  if (sink == SINK_SQLITE) {
+    sql_addStreamSegment(Tcp4Connection.inStreamId, number, offset, length, ts);
+    return;
+  }
+  _addStreamSegment(Tcp4Connection, "addInStreamSegment", &method, number, offset, length, ts);
 }
 
 void Tcp4Connection_setOutStreamData(const char *path) {
+  if (sink == SINK_SQLITE) {
+    sql_setData(Tcp4Connection.outStreamId, path);
+    return;
+  }
   jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "setOutStreamData", "(Ljava/lang/String;)V");
   e();
   jstring argPath = (*jni)->NewStringUTF(jni, path);
@@ -378,6 +1074,10 @@ void Tcp4Connection_setOutStreamData(const char *path) {
 }
 
 void Tcp4Connection_setInStreamData(const char *path) {
+  if (sink == SINK_SQLITE) {
+    sql_setData(Tcp4Connection.inStreamId, path);
+    return;
+  }
   jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "setInStreamData", "(Ljava/lang/String;)V");
   e();
   jstring argPath = (*jni)->NewStringUTF(jni, path);
@@ -392,6 +1092,12 @@ void Tcp4Connection_setInStreamData(const char *path) {
 }
 
 void Tcp4Connection_setFinalStatus(int finalStatus) {
+  if (sink == SINK_SQLITE) {
+    sqlite3_bind_int(sql_stmts[SET_TCP4CONNECTION_FINALSTATUS], 1, Tcp4Connection.id);
+    sqlite3_bind_int(sql_stmts[SET_TCP4CONNECTION_FINALSTATUS], 2, finalStatus);
+    sql_exec(SET_TCP4CONNECTION_FINALSTATUS);
+    return;
+  }
   jmethodID method = (*jni)->GetMethodID(jni, Tcp4Connection.class, "setFinalStatus", "(I)V");
   e();
 
@@ -400,31 +1106,58 @@ void Tcp4Connection_setFinalStatus(int finalStatus) {
 }
 
 int Udp4Stream_getId() {
+  if (sink == SINK_SQLITE) {
+    return Udp4Stream.id;
+  }
   return _getId(Udp4Stream);
 }
 
 int Udp4Stream_getStreamId() {
+  if (sink == SINK_SQLITE) {
+    return Udp4Stream.streamId;
+  }
   jmethodID method = (*jni)->GetMethodID(jni, Udp4Stream.class, "getStreamId", "()I");
   e();
   return (int) (*jni)->CallIntMethod(jni, Udp4Stream.object, method);
 }
 
-void Udp4Stream_addStreamSegment(int length, struct timeval *ts) {
-  _addStreamSegment(Udp4Stream, length, ts);
+void Udp4Stream_addStreamSegment(long number, long offset, int length, struct timeval *ts) {
+  static jmethodID method = NULL;
+
+  if (sink == SINK_SQLITE) {
+    sql_addStreamSegment(Udp4Stream.streamId, number, offset, length, ts);
+    return;
+  }
+  _addStreamSegment(Udp4Stream, "addStreamSegment", &method, number, offset, length, ts);
 }
 
 void Udp4Stream_setLastTime(struct timeval *ts) {
+  if (sink == SINK_SQLITE) {
+    sql_setLastTime(SET_IP4STREAM_LASTTIME, Udp4Stream.streamId, ts);
+    return;
+  }
   _setLastTime(Udp4Stream, ts);
 }
 
 void Udp4Stream_setData(const char *path) {
+  if (sink == SINK_SQLITE) {
+    sql_setData(Udp4Stream.streamId, path);
+    return;
+  }
   _setData(Udp4Stream, path);
 }
 
+/* delete the local reference to the current entity object explicitly, nothing to do with SQLite */
+void release(persistentobject o) {
+  if (sink == SINK_H2) {
+    (*jni)->DeleteLocalRef(jni, o.object);
+  }
+}
 
-/* Util's peristent object "factories" */
 
-jobject Util_newIp4Stream(struct tuple3 t3, struct timeval *ts) {
+/* Util's peristent object "factories", they set the current persistent object to the new one */
+
+void Util_newIp4Stream(struct tuple3 t3, struct timeval *ts) {
   jmethodID method;
   jobject res;
 
@@ -432,6 +1165,11 @@ jobject Util_newIp4Stream(struct tuple3 t3, struct timeval *ts) {
   jint proto;
   jobject firstTime;
 
+  if (sink == SINK_SQLITE) {
+    Ip4Stream.id = sql_insertIp4Stream(t3.daddr, t3.saddr, t3.ip_p, ts);
+    return;
+  }
+
   destIp = (*jni)->NewStringUTF(jni, int_ntoa(t3.daddr));
   e();
   sourceIp = (*jni)->NewStringUTF(jni, int_ntoa(t3.saddr));
@@ -450,10 +1188,10 @@ jobject Util_newIp4Stream(struct tuple3 t3, struct timeval *ts) {
   (*jni)->DeleteLocalRef(jni, sourceIp);
   (*jni)->DeleteLocalRef(jni, firstTime);
 
-  return res;  
+  Ip4Stream.object = res;
 }
 
-jobject Util_newTcp4Connection(struct tuple4 addr, struct timeval *ts) {
+void Util_newTcp4Connection(struct tuple4 addr, struct timeval *ts) {
   jmethodID method;
   jobject res;
 
@@ -461,6 +1199,20 @@ jobject Util_newTcp4Connection(struct tuple4 addr, struct timeval *ts) {
   jint destPort, sourcePort;
   jobject firstTime;
 
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[INSERT_TCP4CONNECTION];
+
+    Tcp4Connection.outStreamId = sql_insertIp4Stream(addr.daddr, addr.saddr, IPPROTO_TCP, ts);
+    Tcp4Connection.inStreamId = sql_insertIp4Stream(addr.saddr, addr.daddr, IPPROTO_TCP, ts);
+    sqlite3_bind_int(s, 1, addr.dest);
+    sqlite3_bind_int(s, 2, addr.source);
+    sqlite3_bind_int(s, 3, Tcp4Connection.outStreamId);
+    sqlite3_bind_int(s, 4, Tcp4Connection.inStreamId);
+    sqlite3_bind_int(s, 5, Tcp4Connection.id = ++lastTcp4ConnectionId);
+    sql_exec(INSERT_TCP4CONNECTION);
+    return;
+  }
+
   destIp = (*jni)->NewStringUTF(jni, int_ntoa(addr.daddr));
   e();
   sourceIp = (*jni)->NewStringUTF(jni, int_ntoa(addr.saddr));
@@ -480,10 +1232,10 @@ jobject Util_newTcp4Connection(struct tuple4 addr, struct timeval *ts) {
   (*jni)->DeleteLocalRef(jni, sourceIp);
   (*jni)->DeleteLocalRef(jni, firstTime);
 
-  return res;
+  Tcp4Connection.object = res;
 }
 
-jobject Util_newUdp4Stream(struct tuple4 addr, struct timeval *ts) {
+void Util_newUdp4Stream(struct tuple4 addr, struct timeval *ts) {
   jmethodID method;
   jobject res;
 
@@ -491,6 +1243,18 @@ jobject Util_newUdp4Stream(struct tuple4 addr, struct timeval *ts) {
   jint destPort, sourcePort;
   jobject firstTime;
 
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[INSERT_UDP4STREAM];
+
+    Udp4Stream.streamId = sql_insertIp4Stream(addr.daddr, addr.saddr, IPPROTO_UDP, ts);
+    sqlite3_bind_int(s, 1, addr.dest);
+    sqlite3_bind_int(s, 2, addr.source);
+    sqlite3_bind_int(s, 3, Udp4Stream.streamId);
+    sqlite3_bind_int(s, 4, Udp4Stream.id = ++lastUdp4StreamId);
+    sql_exec(INSERT_UDP4STREAM);
+    return;
+  }
+
   destIp = (*jni)->NewStringUTF(jni, int_ntoa(addr.daddr));
   e();
   sourceIp = (*jni)->NewStringUTF(jni, int_ntoa(addr.saddr));
@@ -510,103 +1274,2796 @@ jobject Util_newUdp4Stream(struct tuple4 addr, struct timeval *ts) {
   (*jni)->DeleteLocalRef(jni, sourceIp);
   (*jni)->DeleteLocalRef(jni, firstTime);
 
-  return res;
+  Udp4Stream.object = res;
 }
 
 
-/* Proxy functions for Util's interface for looking up objects */
+/* Proxy functions for Util's interface for looking up objects, they set the current persistent object to the one found
+   and return 0 if there is none */
 
-jobject Util_findTcp4Connection(int id) {
+int Util_findTcp4Connection(int id) {
   jmethodID method;
   jobject res;
+  int found;
 
   jint argId = id;
 
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[FIND_TCP4CONNECTION];
+
+    sqlite3_bind_int(s, 1, id);
+    if ((found = sql_query(FIND_TCP4CONNECTION))) {
+      Tcp4Connection.id = id;
+      Tcp4Connection.outStreamId = sqlite3_column_int(s, 0);
+      Tcp4Connection.inStreamId = sqlite3_column_int(s, 1);
+    }
+    sql_done(FIND_TCP4CONNECTION);
+    return found;
+  }
+
   method = (*jni)->GetMethodID(jni, Util.class, "findTcp4Connection", "(I)Lpcap2sql/orm/Tcp4Connection;");
   e();
   
   res = (*jni)->CallObjectMethod(jni, Util.object, method, argId);
   e();
 
-  return res;
+  Tcp4Connection.object = res;
+  return res != NULL;
 }
 
-jobject Util_findIp4Stream(struct tuple3 t3) {
+int Util_findIp4Stream(int id) {
   jmethodID method;
   jobject res;
 
-  jstring destIp, sourceIp;
-  jint proto;
+  if (sink == SINK_SQLITE) {
+    Ip4Stream.id = id;
+    return 1;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "findIp4Stream", "(I)Lpcap2sql/orm/Ip4Stream;");
+  e();
+  res = (*jni)->CallObjectMethod(jni, Util.object, method, (jint) id);
+  e();
+
+  Ip4Stream.object = res;
+  return res != NULL;
+}
+
+/* with SQLite, Udp4Stream.streamId must be set by the caller */
+int Util_findUdp4Stream(int id) {
+  jmethodID method;
+  jobject res;
+
+  if (sink == SINK_SQLITE) {
+    Udp4Stream.id = id;
+    return 1;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "findUdp4Stream", "(I)Lpcap2sql/orm/Udp4Stream;");
+  e();
+  res = (*jni)->CallObjectMethod(jni, Util.object, method, (jint) id);
+  e();
+
+  Udp4Stream.object = res;
+  return res != NULL;
+}
+
+
+/* Detaches the entity object from the persistence context once all of its data has been stored, so that it can be
+   garbage collected. Nothing to do with SQLite. */
+void Util_evict(jobject object) {
+  jmethodID method;
+
+  if (sink == SINK_SQLITE) {
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "evict", "(Ljava/lang/Object;)V");
+  e();
+  (*jni)->CallVoidMethod(jni, Util.object, method, object);
+  e();
+}
+
+
+/* Proxy function for Util's interface for flow summaries, inStreamId is 0 for flows with only one direction and
+   finalStatus -1 for connections not closed and for flows other than TCP */
+void Util_newFlowSummary(int streamId, int proto, int flowId, int inStreamId, struct counters *c, int finalStatus) {
+  jmethodID method;
+  jobject argFirstTime, argLastTime;
+  double duration = (c->lastTime.tv_sec - c->firstTime.tv_sec) + (c->lastTime.tv_usec - c->firstTime.tv_usec) / 1e6;
+  long packets = c->outPackets + c->inPackets;
+  double meanInterArrival = packets > 1 ? duration / (packets - 1) : -1;
+
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[INSERT_FLOWSUMMARY];
+
+    sqlite3_bind_int(s, 1, streamId);
+    sqlite3_bind_int(s, 2, proto);
+    sqlite3_bind_int(s, 3, flowId);
+    if (inStreamId != 0) {
+      sqlite3_bind_int(s, 4, inStreamId);
+    }
+    sqlite3_bind_text(s, 5, to_timestring(&c->firstTime), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(s, 6, to_timestring(&c->lastTime), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_double(s, 7, duration);
+    sqlite3_bind_int64(s, 8, c->outPackets);
+    sqlite3_bind_int64(s, 9, c->outBytes);
+    sqlite3_bind_int64(s, 10, c->inPackets);
+    sqlite3_bind_int64(s, 11, c->inBytes);
+    if (meanInterArrival >= 0) {
+      sqlite3_bind_double(s, 12, meanInterArrival);
+    }
+    if (finalStatus != -1) {
+      sqlite3_bind_int(s, 13, finalStatus);
+    }
+    sql_exec(INSERT_FLOWSUMMARY);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "newFlowSummary", "(IIIILjava/sql/Timestamp;Ljava/sql/Timestamp;DJJJJDI)V");
+  e();
+  argFirstTime = to_Timestamp(&c->firstTime);
+  argLastTime = to_Timestamp(&c->lastTime);
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) streamId, (jint) proto, (jint) flowId, (jint) inStreamId,
+			 argFirstTime, argLastTime, (jdouble) duration, (jlong) c->outPackets, (jlong) c->outBytes,
+			 (jlong) c->inPackets, (jlong) c->inBytes, (jdouble) meanInterArrival, (jint) finalStatus);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argFirstTime);
+  (*jni)->DeleteLocalRef(jni, argLastTime);
+}
+
+
+/* Proxy functions for Util's interface for records extracted from the payload, the strings may be NULL */
+
+jstring to_jstring(const char *s) {
+  jstring res;
+
+  if (s == NULL) {
+    return NULL;
+  }
+  res = (*jni)->NewStringUTF(jni, s);
+  e();
+  return res;
+}
+
+void Util_newHttpRequest(int streamId, long segment, int number, struct timeval *ts, const char *httpMethod,
+			 const char *uri, const char *version, const char *host, const char *userAgent) {
+  jmethodID method;
+  jobject argTime;
+  jstring argMethod, argUri, argVersion, argHost, argUserAgent;
+
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[INSERT_HTTPREQUEST];
+
+    sqlite3_bind_int(s, 1, streamId);
+    sqlite3_bind_int64(s, 2, segment);
+    sqlite3_bind_int(s, 3, number);
+    sqlite3_bind_text(s, 4, to_timestring(ts), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(s, 5, httpMethod, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(s, 6, uri, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(s, 7, version, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(s, 8, host, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(s, 9, userAgent, -1, SQLITE_TRANSIENT);
+    sql_exec(INSERT_HTTPREQUEST);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "newHttpRequest", "(IJILjava/sql/Timestamp;Ljava/lang/String;"
+			       "Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;)V");
+  e();
+  argTime = to_Timestamp(ts);
+  argMethod = to_jstring(httpMethod);
+  argUri = to_jstring(uri);
+  argVersion = to_jstring(version);
+  argHost = to_jstring(host);
+  argUserAgent = to_jstring(userAgent);
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) streamId, (jlong) segment, (jint) number, argTime,
+			 argMethod, argUri, argVersion, argHost, argUserAgent);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argTime);
+  (*jni)->DeleteLocalRef(jni, argMethod);
+  (*jni)->DeleteLocalRef(jni, argUri);
+  (*jni)->DeleteLocalRef(jni, argVersion);
+  (*jni)->DeleteLocalRef(jni, argHost);
+  (*jni)->DeleteLocalRef(jni, argUserAgent);
+}
+
+void Util_newTlsClientHello(int streamId, long segment, int number, struct timeval *ts, int version,
+			    const char *serverName) {
+  jmethodID method;
+  jobject argTime;
+  jstring argServerName;
+
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[INSERT_TLSCLIENTHELLO];
+
+    sqlite3_bind_int(s, 1, streamId);
+    sqlite3_bind_int64(s, 2, segment);
+    sqlite3_bind_int(s, 3, number);
+    sqlite3_bind_text(s, 4, to_timestring(ts), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(s, 5, version);
+    sqlite3_bind_text(s, 6, serverName, -1, SQLITE_TRANSIENT);
+    sql_exec(INSERT_TLSCLIENTHELLO);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "newTlsClientHello", "(IJILjava/sql/Timestamp;ILjava/lang/String;)V");
+  e();
+  argTime = to_Timestamp(ts);
+  argServerName = to_jstring(serverName);
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) streamId, (jlong) segment, (jint) number, argTime,
+			 (jint) version, argServerName);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argTime);
+  (*jni)->DeleteLocalRef(jni, argServerName);
+}
+
+void Util_newDnsRecord(int streamId, long segment, int number, struct timeval *ts, int transactionId, int response,
+		       int rcode, int section, const char *name, int type, const char *data) {
+  jmethodID method;
+  jobject argTime;
+  jstring argName, argData;
+
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[INSERT_DNSRECORD];
+
+    sqlite3_bind_int(s, 1, streamId);
+    sqlite3_bind_int64(s, 2, segment);
+    sqlite3_bind_int(s, 3, number);
+    sqlite3_bind_text(s, 4, to_timestring(ts), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(s, 5, transactionId);
+    sqlite3_bind_int(s, 6, response);
+    sqlite3_bind_int(s, 7, rcode);
+    sqlite3_bind_int(s, 8, section);
+    sqlite3_bind_text(s, 9, name, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(s, 10, type);
+    sqlite3_bind_text(s, 11, data, -1, SQLITE_TRANSIENT);
+    sql_exec(INSERT_DNSRECORD);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "newDnsRecord",
+			       "(IJILjava/sql/Timestamp;IZIILjava/lang/String;ILjava/lang/String;)V");
+  e();
+  argTime = to_Timestamp(ts);
+  argName = to_jstring(name);
+  argData = to_jstring(data);
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) streamId, (jlong) segment, (jint) number, argTime,
+			 (jint) transactionId, (jboolean) (response != 0), (jint) rcode, (jint) section, argName,
+			 (jint) type, argData);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argTime);
+  (*jni)->DeleteLocalRef(jni, argName);
+  (*jni)->DeleteLocalRef(jni, argData);
+}
+
+
+/* Proxy function for Util's interface for the payload index, grams are the n distinct trigrams of the stream */
+void Util_addPayloadGrams(int streamId, int *grams, int n) {
+  jmethodID method;
+  jintArray argGrams;
+  u_char gram[3];
+  int i;
+
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[INSERT_PAYLOADGRAM];
+
+    for (i = 0; i < n; i++) {
+      gram[0] = grams[i] >> 16;
+      gram[1] = grams[i] >> 8;
+      gram[2] = grams[i];
+      sqlite3_bind_int(s, 1, streamId);
+      sqlite3_bind_blob(s, 2, gram, 3, SQLITE_TRANSIENT);
+      sql_exec(INSERT_PAYLOADGRAM);
+    }
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "addPayloadGrams", "(I[I)V");
+  e();
+  argGrams = (*jni)->NewIntArray(jni, n);
+  e();
+  (*jni)->SetIntArrayRegion(jni, argGrams, 0, n, (jint *) grams);
+  e();
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) streamId, argGrams);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argGrams);
+}
+
+/* Proxy function for Util's interface for payload tags, the n matches of the patterns found in segment */
+void Util_addPayloadTags(int streamId, long segment, int *patterns, jlong *offsets, int n) {
+  jmethodID method;
+  jintArray argPatterns;
+  jlongArray argOffsets;
+  int i;
+
+  if (sink == SINK_SQLITE) {
+    sqlite3_stmt *s = sql_stmts[INSERT_PAYLOADTAG];
+
+    for (i = 0; i < n; i++) {
+      sqlite3_bind_int(s, 1, streamId);
+      sqlite3_bind_int64(s, 2, segment);
+      sqlite3_bind_int(s, 3, patterns[i]);
+      sqlite3_bind_int64(s, 4, offsets[i]);
+      sql_exec(INSERT_PAYLOADTAG);
+    }
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "addPayloadTags", "(IJ[I[J)V");
+  e();
+  argPatterns = (*jni)->NewIntArray(jni, n);
+  e();
+  (*jni)->SetIntArrayRegion(jni, argPatterns, 0, n, (jint *) patterns);
+  e();
+  argOffsets = (*jni)->NewLongArray(jni, n);
+  e();
+  (*jni)->SetLongArrayRegion(jni, argOffsets, 0, n, offsets);
+  e();
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) streamId, (jlong) segment, argPatterns, argOffsets);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argPatterns);
+  (*jni)->DeleteLocalRef(jni, argOffsets);
+}
+
+
+/* Proxy functions for Util's interface for checkpoints */
+
+void Util_checkpoint() {
+  jmethodID method;
+
+  if (sink == SINK_SQLITE) {
+    sql_commit();
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "checkpoint", "()V");
+  e();
+  (*jni)->CallVoidMethod(jni, Util.object, method);
+  e();
+}
+
+void Util_rollback(int maxIp4StreamId, int maxTcp4ConnectionId, int maxUdp4StreamId) {
+  jmethodID method;
+
+  if (sink == SINK_SQLITE) {
+    sql_rollback(maxIp4StreamId, maxTcp4ConnectionId, maxUdp4StreamId);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "rollback", "(III)V");
+  e();
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) maxIp4StreamId, (jint) maxTcp4ConnectionId, (jint) maxUdp4StreamId);
+  e();
+}
+
+void Util_rollbackIp4Stream(int id, long segments, struct timeval *lastTime) {
+  jmethodID method;
+  jobject argTime;
+
+  if (sink == SINK_SQLITE) {
+    sql_rollbackIp4Stream(id, segments, lastTime);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "rollbackIp4Stream", "(IJLjava/sql/Timestamp;)V");
+  e();
+  argTime = lastTime != NULL ? to_Timestamp(lastTime) : NULL;
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) id, (jlong) segments, argTime);
+  e();
+
+  /* delete local references explicitly */
+  if (argTime != NULL) {
+    (*jni)->DeleteLocalRef(jni, argTime);
+  }
+}
+
+void Util_rollbackTcp4Connection(int id, struct timeval *lastTime) {
+  jmethodID method;
+  jobject argTime;
+
+  if (sink == SINK_SQLITE) {
+    sql_rollbackTcp4Connection(id, lastTime);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "rollbackTcp4Connection", "(ILjava/sql/Timestamp;)V");
+  e();
+  argTime = lastTime != NULL ? to_Timestamp(lastTime) : NULL;
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) id, argTime);
+  e();
+
+  /* delete local references explicitly */
+  if (argTime != NULL) {
+    (*jni)->DeleteLocalRef(jni, argTime);
+  }
+}
+
+
+/* Proxy functions for Util's interface for partitions */
+
+void Util_openPartition(struct partition *p) {
+  jmethodID method;
+  jstring argName;
+  jobject argStartTime, argEndTime;
+  struct timeval end = {p->start + partitioninterval, 0};
+
+  if (sink == SINK_SQLITE) {
+    sql_openPartition(p);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "openPartition", "(ILjava/lang/String;Ljava/sql/Timestamp;Ljava/sql/Timestamp;III)V");
+  e();
+  argName = (*jni)->NewStringUTF(jni, p->name);
+  e();
+  argStartTime = to_Timestamp(&p->startTime);
+  argEndTime = to_Timestamp(&end);
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) p->index, argName, argStartTime, argEndTime,
+			 (jint) lastIp4StreamId + 1, (jint) lastTcp4ConnectionId + 1, (jint) lastUdp4StreamId + 1);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argName);
+  (*jni)->DeleteLocalRef(jni, argStartTime);
+  (*jni)->DeleteLocalRef(jni, argEndTime);
+}
+
+void Util_usePartition(struct partition *p) {
+  jmethodID method;
+
+  if (sink == SINK_SQLITE) {
+    db = p->db;
+    sql_stmts = p->stmts;
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "usePartition", "(I)V");
+  e();
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) p->index);
+  e();
+}
+
+void Util_closePartition(struct partition *p) {
+  jmethodID method;
+  jobject argStartTime;
+
+  if (sink == SINK_SQLITE) {
+    sql_closePartition(p);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "closePartition", "(ILjava/sql/Timestamp;)V");
+  e();
+  argStartTime = to_Timestamp(&p->startTime);
+  (*jni)->CallVoidMethod(jni, Util.object, method, (jint) p->index, argStartTime);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argStartTime);
+}
+
+void Util_dropPartitionsAfter(const char *name) {
+  jmethodID method;
+  jstring argName;
+
+  if (sink == SINK_SQLITE) {
+    sql_dropPartitionsAfter(name);
+    return;
+  }
+
+  method = (*jni)->GetMethodID(jni, Util.class, "dropPartitionsAfter", "(Ljava/lang/String;)V");
+  e();
+  argName = (*jni)->NewStringUTF(jni, name);
+  e();
+  (*jni)->CallVoidMethod(jni, Util.object, method, argName);
+  e();
+
+  /* delete local references explicitly */
+  (*jni)->DeleteLocalRef(jni, argName);
+}
+
+
+/* partitions
+
+   With partitioninterval set, the output is split into one database per interval, named DBNAME_YYYYMMDDTHHMMSS after
+   the start of the interval (UTC). Flows and TCP connections are stored in the partition their first packet falls in,
+   the table TimePartition in the database DBNAME catalogs them. Partitions are only ever added after the newest one,
+   a flow starting before it (captures merged out of order) is added to the newest one and lowers its startTime, so
+   that the ids, handed out in order, are unique over all partitions. A partition is closed once a newer one exists
+   and all of its flows and connections are finished.
+
+   Without partitioninterval, there is just one partition: the database DBNAME. */
+
+/* selects the partition the proxy functions work on */
+void use_partition(struct partition *p) {
+  if (p != partition) {
+    partition = p;
+    Util_usePartition(p);
+  }
+}
+
+/* opens a partition as the newest one, startTime is the one of its interval if NULL */
+struct partition *partition_open(time_t start, struct timeval *startTime) {
+  struct partition *p;
+  struct tm tm;
+
+  p = calloc(1, sizeof(struct partition));
+  if (p == NULL) {
+    die("out of memory");
+  }
+  p->start = start;
+  if (partitioninterval > 0) {
+    p->index = start / partitioninterval;
+    gmtime_r(&start, &tm);
+    strftime(p->name, sizeof(p->name), DBNAME "_%Y%m%dT%H%M%S", &tm);
+  } else {
+    strcpy(p->name, DBNAME);
+  }
+  p->startTime.tv_sec = start;
+  if (startTime != NULL) {
+    p->startTime = *startTime;
+  }
+
+  logf("opening partition %s", p->name);
+  p->next = partitions;
+  partitions = p;
+  Util_openPartition(p);
+  return p;
+}
+
+void partition_close(struct partition *p) {
+  struct partition **prev;
+
+  logf("closing partition %s", p->name);
+  for (prev = &partitions; *prev != p; prev = &(*prev)->next);
+  *prev = p->next;
+  Util_closePartition(p);
+  if (partition == p) {
+    partition = NULL;
+  }
+  free(p);
+}
+
+/* returns the partition a flow or connection starting at ts is stored in */
+struct partition *partition_for(struct timeval *ts) {
+  struct partition *newest = partitions;
+  time_t start;
+
+  if (partitioninterval == 0) {
+    return partitions;
+  }
+
+  start = ts->tv_sec - ts->tv_sec % partitioninterval;
+  if (newest == NULL || start > newest->start) {
+    partition_open(start, NULL);
+    if (newest != NULL && newest->refs == 0) {
+      partition_close(newest);
+    }
+  }
+  if (timercmp(ts, &partitions->startTime, <)) {
+    partitions->startTime = *ts;
+  }
+  return partitions;
+}
+
+/* looks up an open partition by its index */
+struct partition *partition_find(int index) {
+  struct partition *p;
+
+  for (p = partitions; p != NULL && p->index != index; p = p->next);
+  return p;
+}
+
+/* called when a flow or connection stored in p is finished */
+void partition_release(struct partition *p) {
+  if (--p->refs == 0 && p != partitions) {
+    partition_close(p);
+  }
+}
+
+void close_all_partitions() {
+  while (partitions != NULL) {
+    partition_close(partitions);
+  }
+}
+
+
+/* payload index
+
+   With -g, the distinct 3 byte sequences (trigrams) of the stored payload of each stream are recorded in the table
+   PayloadGram once the stream is finished. Only streams containing all trigrams of a byte pattern can contain the
+   pattern, so a search just has to read the payload of the streams the index lists for all of them. */
+
+#define GRAM_COUNT (1 << 24)
+
+int payloadindex = 0;
+u_char *gramseen = NULL; // bitmap of the trigrams found in the stream being indexed
+int *grams = NULL; // the trigrams found in the stream being indexed
+int gramssize = 0;
+
+/* indexes the stream file of a finished stream, in the current partition */
+void index_payload(int streamId) {
+  u_char buf[65536];
+  ssize_t len;
+  int fd, i, g = 0, have = 0, count = 0;
+
+  if (!payloadindex) {
+    return;
+  }
+  if (gramseen == NULL) {
+    gramseen = calloc(GRAM_COUNT / 8, 1);
+    if (gramseen == NULL) {
+      die("out of memory");
+    }
+  }
+
+  fd = open(to_streamfile_path(streamId), O_RDONLY);
+  if (fd == -1) {
+    logf("failed to open %s for reading: %s", to_streamfile_path(streamId), strerror(errno));
+    return;
+  }
+  while ((len = read(fd, buf, sizeof(buf))) > 0) {
+    for (i = 0; i < len; i++) {
+      g = ((g << 8) | buf[i]) & (GRAM_COUNT - 1);
+      if (have < 2) {
+	have++;
+	continue;
+      }
+      if (gramseen[g >> 3] & (1 << (g & 7))) {
+	continue;
+      }
+      gramseen[g >> 3] |= 1 << (g & 7);
+      if (count == gramssize) {
+	gramssize = gramssize > 0 ? 2 * gramssize : 4096;
+	grams = realloc(grams, gramssize * sizeof(int));
+	if (grams == NULL) {
+	  die("out of memory");
+	}
+      }
+      grams[count++] = g;
+    }
+  }
+  if (len == -1) {
+    logf("failed to read %s: %s", to_streamfile_path(streamId), strerror(errno));
+  }
+  close(fd);
+
+  /* clear only the bits set, the bitmap is reused for the next stream */
+  for (i = 0; i < count; i++) {
+    gramseen[grams[i] >> 3] = 0;
+  }
+  if (count > 0) {
+    Util_addPayloadGrams(streamId, grams, count);
+  }
+}
+
+
+/* payload tags
+
+   With -T <file>, the payload of all streams is matched against the patterns in the file while it is captured, and
+   each match is stored in the table PayloadTag: the id of the pattern, the offset of its first byte in the stream and
+   the segment it ends in. The patterns are compiled into a single Aho-Corasick automaton, so that all of them are
+   matched in one pass over the data while it is still in the cache. A stream only needs to keep the state of the
+   automaton to find the matches crossing segment boundaries.
+
+   Where SSSE3 or AVX2 is available, the bytes that cannot start a match are skipped 16 or 32 at a time while the
+   automaton is in its initial state: each byte is looked up by its low and high nibble in two 16 byte tables at once,
+   like the bucketed nibble masks of the Teddy algorithm. */
+
+#define TAG_MAX_LINE 4096
+/* with more distinct first bytes, too few bytes are skipped to pay off */
+#define TAG_MAX_SKIPPED 128
+
+struct tagpattern {
+  int id;
+  int len;
+  int next; // next pattern ending in the same state, -1 for none
+};
+
+int tagging = 0;
+struct tagpattern *tagpatterns = NULL;
+int tagstates = 0;
+int tagclasses = 0; // bytes not occurring in any pattern are in class 0
+u_char tagclass[256];
+int *tagdelta = NULL; // transitions, tagstates rows of tagclasses states
+int *tagfail = NULL;
+int *tagoutput = NULL; // first pattern ending in the state, -1 for none
+int *tagmatch = NULL; // the state itself or its longest suffix state with an output, -1 for none
+/* bytes starting a pattern by their low and high nibble, byte b is in bucket (b >> 4) & 7 */
+u_char tagnibblelo[16] __attribute__((aligned(16)));
+u_char tagnibblehi[16] __attribute__((aligned(16)));
+int (*tag_skip)(const u_char *data, int i, int len) = NULL;
+/* matches found in the data being tagged */
+int *tagmatchpatterns = NULL;
+jlong *tagmatchoffsets = NULL;
+int tagmatchessize = 0;
+long tagcount = 0;
+
+/* returns the offset of the first byte at or after i in data that may start a pattern, len if there is none */
+int tag_skip_scalar(const u_char *data, int i, int len) {
+  while (i < len && !(tagnibblelo[data[i] & 0x0f] & tagnibblehi[data[i] >> 4])) {
+    i++;
+  }
+  return i;
+}
+
+#ifdef TAG_SIMD
+__attribute__((target("ssse3")))
+int tag_skip_ssse3(const u_char *data, int i, int len) {
+  __m128i lo = _mm_load_si128((const __m128i *) tagnibblelo);
+  __m128i hi = _mm_load_si128((const __m128i *) tagnibblehi);
+  __m128i nibble = _mm_set1_epi8(0x0f);
+  __m128i v, candidates;
+  u_int mask;
+
+  for (; i + 16 <= len; i += 16) {
+    v = _mm_loadu_si128((const __m128i *) (data + i));
+    candidates = _mm_and_si128(_mm_shuffle_epi8(lo, _mm_and_si128(v, nibble)),
+			       _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi16(v, 4), nibble)));
+    mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(candidates, _mm_setzero_si128())) & 0xffff;
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return tag_skip_scalar(data, i, len);
+}
+
+__attribute__((target("avx2")))
+int tag_skip_avx2(const u_char *data, int i, int len) {
+  __m256i lo = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) tagnibblelo));
+  __m256i hi = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) tagnibblehi));
+  __m256i nibble = _mm256_set1_epi8(0x0f);
+  __m256i v, candidates;
+  u_int mask;
+
+  for (; i + 32 <= len; i += 32) {
+    v = _mm256_loadu_si256((const __m256i *) (data + i));
+    candidates = _mm256_and_si256(_mm256_shuffle_epi8(lo, _mm256_and_si256(v, nibble)),
+				  _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+    mask = ~(u_int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(candidates, _mm256_setzero_si256()));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return tag_skip_scalar(data, i, len);
+}
+#endif
+
+/* parses a pattern given in hex or as text in double quotes into buf, returns its length or -1 */
+int tag_parse_pattern(char *spec, u_char *buf) {
+  char *end;
+  int len = 0;
+  u_int b;
+
+  if (*spec == '"') {
+    end = strrchr(spec, '"');
+    if (end == spec) {
+      return -1;
+    }
+    len = end - spec - 1;
+    memcpy(buf, spec + 1, len);
+    return end[1] == '\0' ? len : -1;
+  }
+  while (*spec != '\0') {
+    if (sscanf(spec, "%2x", &b) != 1 || !isxdigit((u_char) spec[0]) || !isxdigit((u_char) spec[1])) {
+      return -1;
+    }
+    buf[len++] = b;
+    spec += 2;
+  }
+  return len;
+}
+
+/* reads the patterns from the file at path and compiles them, returns -1 on errors. Each line holds the id of a
+   pattern and the pattern, either in hex or as text in double quotes, lines starting with # are ignored e.g.
+
+   1 4d5a90
+   2 "SSH-" */
+int tags_load(const char *path) {
+  FILE *file;
+  char line[TAG_MAX_LINE];
+  char *spec, *end;
+  u_char **patterns = NULL;
+  int n = 0, size = 0, total = 0, lineno = 0;
+  int i, j, c, s, t, len, id, head, tail;
+  int *queue;
+
+  file = fopen(path, "r");
+  if (file == NULL) {
+    logf("failed to open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  /* read the patterns, each one preceded by its length */
+  while (fgets(line, sizeof(line), file) != NULL) {
+    lineno++;
+    len = strlen(line);
+    if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+      logf("%s:%d: line too long", path, lineno);
+      fclose(file);
+      return -1;
+    }
+    while (len > 0 && isspace((u_char) line[len - 1])) {
+      line[--len] = '\0';
+    }
+    for (spec = line; isspace((u_char) *spec); spec++);
+    if (*spec == '\0' || *spec == '#') {
+      continue;
+    }
+    id = strtol(spec, &end, 10);
+    if (end == spec || !isspace((u_char) *end)) {
+      logf("%s:%d: pattern id expected", path, lineno);
+      fclose(file);
+      return -1;
+    }
+    for (spec = end; isspace((u_char) *spec); spec++);
+    if (n == size) {
+      size = size > 0 ? 2 * size : 256;
+      patterns = realloc(patterns, size * sizeof(u_char *));
+      tagpatterns = realloc(tagpatterns, size * sizeof(struct tagpattern));
+      if (patterns == NULL || tagpatterns == NULL) {
+	die("out of memory");
+      }
+    }
+    patterns[n] = malloc(strlen(spec));
+    if (patterns[n] == NULL) {
+      die("out of memory");
+    }
+    len = tag_parse_pattern(spec, patterns[n]);
+    if (len <= 0) {
+      logf("%s:%d: empty or malformed pattern", path, lineno);
+      fclose(file);
+      return -1;
+    }
+    tagpatterns[n].id = id;
+    tagpatterns[n].len = len;
+    tagpatterns[n].next = -1;
+    total += len;
+    n++;
+  }
+  fclose(file);
+  if (n == 0) {
+    logf("%s: no patterns", path);
+    return -1;
+  }
+
+  /* number the bytes occurring in the patterns, the other ones all lead back to the initial state */
+  memset(tagclass, 0, sizeof(tagclass));
+  for (i = 0; i < n; i++) {
+    for (j = 0; j < tagpatterns[i].len; j++) {
+      tagclass[patterns[i][j]] = 1;
+    }
+  }
+  tagclasses = 1;
+  for (i = 0; i < 256; i++) {
+    if (tagclass[i]) {
+      tagclass[i] = tagclasses++;
+    }
+  }
+
+  /* the trie of the patterns, an edge to state 0 means there is none */
+  tagdelta = calloc((size_t) (total + 1) * tagclasses, sizeof(int));
+  tagoutput = malloc((total + 1) * sizeof(int));
+  if (tagdelta == NULL || tagoutput == NULL) {
+    die("out of memory");
+  }
+  tagoutput[0] = -1;
+  tagstates = 1;
+  memset(tagnibblelo, 0, sizeof(tagnibblelo));
+  memset(tagnibblehi, 0, sizeof(tagnibblehi));
+  for (i = 0; i < n; i++) {
+    c = patterns[i][0];
+    tagnibblelo[c & 0x0f] |= 1 << ((c >> 4) & 7);
+    tagnibblehi[c >> 4] |= 1 << ((c >> 4) & 7);
+    for (s = 0, j = 0; j < tagpatterns[i].len; j++) {
+      t = tagdelta[s * tagclasses + tagclass[patterns[i][j]]];
+      if (t == 0) {
+	t = tagstates++;
+	tagdelta[s * tagclasses + tagclass[patterns[i][j]]] = t;
+	tagoutput[t] = -1;
+      }
+      s = t;
+    }
+    tagpatterns[i].next = tagoutput[s];
+    tagoutput[s] = i;
+    free(patterns[i]);
+  }
+  free(patterns);
+  tagdelta = realloc(tagdelta, (size_t) tagstates * tagclasses * sizeof(int));
+  tagfail = malloc(tagstates * sizeof(int));
+  tagmatch = malloc(tagstates * sizeof(int));
+  queue = malloc(tagstates * sizeof(int));
+  if (tagdelta == NULL || tagfail == NULL || tagmatch == NULL || queue == NULL) {
+    die("out of memory");
+  }
+
+  /* turn the trie into the automaton breadth first, the missing edges of a state lead where those of its longest
+     proper suffix state (fail) lead, which is less deep and so already complete */
+  tagfail[0] = 0;
+  tagmatch[0] = -1;
+  head = tail = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    s = queue[head++];
+    for (c = 0; c < tagclasses; c++) {
+      t = tagdelta[s * tagclasses + c];
+      if (t != 0) {
+	tagfail[t] = s == 0 ? 0 : tagdelta[tagfail[s] * tagclasses + c];
+	tagmatch[t] = tagoutput[t] != -1 ? t : tagmatch[tagfail[t]];
+	queue[tail++] = t;
+      } else if (s != 0) {
+	tagdelta[s * tagclasses + c] = tagdelta[tagfail[s] * tagclasses + c];
+      }
+    }
+  }
+  free(queue);
+
+  /* the vectorized skip of the bytes that cannot start a match */
+  for (i = 0, c = 0; i < 256; i++) {
+    c += (tagnibblelo[i & 0x0f] & tagnibblehi[i >> 4]) != 0;
+  }
+  tag_skip = tag_skip_scalar;
+#ifdef TAG_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    tag_skip = tag_skip_avx2;
+  } else if (__builtin_cpu_supports("ssse3")) {
+    tag_skip = tag_skip_ssse3;
+  }
+#endif
+  if (c > TAG_MAX_SKIPPED) {
+    tag_skip = NULL;
+  }
+
+  logf("%d patterns, %d states, %d byte classes, %d bytes possibly starting a match", n, tagstates, tagclasses, c);
+  tagging = 1;
+  return 0;
+}
+
+/* matches the patterns against len bytes of data continuing a stream, in the current partition. *state is the state
+   of the automaton after the previous data of the stream, offset the number of bytes of the stream before data and
+   segment the StreamSegment data belongs to. */
+void tag_payload(int *state, int streamId, long segment, long offset, const u_char *data, int len) {
+  int i, p, t, n = 0;
+  int s = *state;
+
+  if (!tagging) {
+    return;
+  }
+
+  for (i = 0; i < len; i++) {
+    if (s == 0 && tag_skip != NULL) {
+      i = tag_skip(data, i, len);
+      if (i == len) {
+	break;
+      }
+    }
+    s = tagdelta[s * tagclasses + tagclass[data[i]]];
+    for (t = tagmatch[s]; t != -1; t = tagmatch[tagfail[t]]) {
+      for (p = tagoutput[t]; p != -1; p = tagpatterns[p].next) {
+	if (n == tagmatchessize) {
+	  tagmatchessize = tagmatchessize > 0 ? 2 * tagmatchessize : 256;
+	  tagmatchpatterns = realloc(tagmatchpatterns, tagmatchessize * sizeof(int));
+	  tagmatchoffsets = realloc(tagmatchoffsets, tagmatchessize * sizeof(jlong));
+	  if (tagmatchpatterns == NULL || tagmatchoffsets == NULL) {
+	    die("out of memory");
+	  }
+	}
+	tagmatchpatterns[n] = tagpatterns[p].id;
+	tagmatchoffsets[n] = offset + i + 1 - tagpatterns[p].len;
+	n++;
+      }
+    }
+  }
+  *state = s;
+
+  if (n > 0) {
+    Util_addPayloadTags(streamId, segment, tagmatchpatterns, tagmatchoffsets, n);
+    tagcount += n;
+  }
+}
+
+
+/* flow table
+
+   libnids keeps state only for TCP connections. UDP and raw IP flows are tracked here: the flow table maps the
+   addresses, ports and protocol of a flow to the ids (and with H2, to a global reference of the entity object) of the
+   stream its payload is stored in. Flows are kept in a list ordered by the time of their last packet, so that flows
+   idle for longer than flowtimeout can be finished and evicted while the capture is still being processed. */
+
+struct flow {
+  struct flow *next; // next flow in the same hash bucket
+  struct flow *older; // idle list
+  struct flow *newer;
+  struct tuple4 addr; // ports are 0 for raw IP
+  u_int8_t ip_p;
+  jobject object; // global reference to the Udp4Stream or Ip4Stream entity object with H2
+  struct partition *partition;
+  int id; // Udp4Stream or Ip4Stream id
+  int streamId; // Ip4Stream id
+  struct timeval lastTime; // written to the stream when it is finished or at a checkpoint
+  long stored; // bytes written to the stream file
+  long cap; // payload cap, -1 for none
+  long segments; // number of StreamSegment records
+  int tagstate; // of the automaton matching the tag patterns
+  struct counters counters;
+};
+
+struct flowtable {
+  struct flow **buckets;
+  u_int size; // number of buckets, a power of 2
+  u_int count;
+  struct flow *oldest;
+  struct flow *newest;
+};
+
+#define FLOWTABLE_INITIAL_SIZE 4096
+
+struct flowtable flows;
+/* most flows active at the same time */
+u_int peakflows = 0;
+/* seconds without packets after which a UDP or raw IP flow is finished, 0 means never */
+long flowtimeout = 0;
+
+u_int flow_hash(struct tuple4 *addr, u_int8_t ip_p) {
+  u_int h = addr->saddr * 0x9e3779b1;
+  h ^= addr->daddr + 0x7f4a7c15 + (h << 6) + (h >> 2);
+  h ^= ((addr->source << 16) | addr->dest) + 0x7f4a7c15 + (h << 6) + (h >> 2);
+  h ^= ip_p + 0x7f4a7c15 + (h << 6) + (h >> 2);
+  return h;
+}
+
+void flows_init() {
+  flows.size = FLOWTABLE_INITIAL_SIZE;
+  flows.buckets = calloc(flows.size, sizeof(struct flow *));
+  if (flows.buckets == NULL) {
+    die("out of memory");
+  }
+}
+
+/* doubles the number of buckets */
+void flows_grow() {
+  struct flow **buckets;
+  struct flow *f, *next;
+  u_int size = flows.size * 2;
+  u_int i, h;
+
+  buckets = calloc(size, sizeof(struct flow *));
+  if (buckets == NULL) {
+    log("out of memory, not growing the flow table");
+    return;
+  }
+  for (i = 0; i < flows.size; i++) {
+    for (f = flows.buckets[i]; f != NULL; f = next) {
+      next = f->next;
+      h = flow_hash(&f->addr, f->ip_p) & (size - 1);
+      f->next = buckets[h];
+      buckets[h] = f;
+    }
+  }
+  free(flows.buckets);
+  flows.buckets = buckets;
+  flows.size = size;
+}
+
+void flow_unlink_idle(struct flow *f) {
+  if (f->older != NULL) {
+    f->older->newer = f->newer;
+  } else {
+    flows.oldest = f->newer;
+  }
+  if (f->newer != NULL) {
+    f->newer->older = f->older;
+  } else {
+    flows.newest = f->older;
+  }
+}
+
+void flow_append_idle(struct flow *f) {
+  f->older = flows.newest;
+  f->newer = NULL;
+  if (flows.newest != NULL) {
+    flows.newest->newer = f;
+  } else {
+    flows.oldest = f;
+  }
+  flows.newest = f;
+}
+
+/* looks up a flow and marks it as the most recently active one, returns NULL if there is none */
+struct flow *flow_find(struct tuple4 *addr, u_int8_t ip_p) {
+  struct flow *f;
+
+  for (f = flows.buckets[flow_hash(addr, ip_p) & (flows.size - 1)]; f != NULL; f = f->next) {
+    if (f->ip_p == ip_p && memcmp(&f->addr, addr, sizeof(struct tuple4)) == 0) {
+      flow_unlink_idle(f);
+      flow_append_idle(f);
+      return f;
+    }
+  }
+  return NULL;
+}
+
+/* adds a new flow, the caller sets its ids and object */
+struct flow *flow_add(struct tuple4 *addr, u_int8_t ip_p) {
+  struct flow *f;
+  u_int h;
+
+  if (flows.count >= flows.size * 2) {
+    flows_grow();
+  }
+
+  f = calloc(1, sizeof(struct flow));
+  if (f == NULL) {
+    die("out of memory");
+  }
+  f->addr = *addr;
+  f->ip_p = ip_p;
+
+  h = flow_hash(addr, ip_p) & (flows.size - 1);
+  f->next = flows.buckets[h];
+  flows.buckets[h] = f;
+  flow_append_idle(f);
+  if (++flows.count > peakflows) {
+    peakflows = flows.count;
+  }
+
+  return f;
+}
+
+void flow_remove(struct flow *f) {
+  struct flow **p;
+
+  for (p = &flows.buckets[flow_hash(&f->addr, f->ip_p) & (flows.size - 1)]; *p != f; p = &(*p)->next);
+  *p = f->next;
+  flow_unlink_idle(f);
+  flows.count--;
+  free(f);
+}
+
+/* turns a local reference into a global one that can be held by a flow, NULL with SQLite */
+jobject globalref(jobject object) {
+  jobject ref;
+
+  if (sink == SINK_SQLITE) {
+    return NULL;
+  }
+  ref = (*jni)->NewGlobalRef(jni, object);
+  e();
+  (*jni)->DeleteLocalRef(jni, object);
+  return ref;
+}
+
+/* makes the flow's Udp4Stream or Ip4Stream the current one */
+void flow_use(struct flow *f) {
+  use_partition(f->partition);
+  if (f->ip_p == IPPROTO_UDP) {
+    Udp4Stream.object = f->object;
+    Udp4Stream.id = f->id;
+    Udp4Stream.streamId = f->streamId;
+  } else {
+    Ip4Stream.object = f->object;
+    Ip4Stream.id = f->id;
+  }
+}
+
+/* writes the time of the last packet, which is only kept in the flow while it is active */
+void flow_write_times(struct flow *f) {
+  flow_use(f);
+  if (f->ip_p == IPPROTO_UDP) {
+    Udp4Stream_setLastTime(&f->lastTime);
+  } else {
+    Ip4Stream_setLastTime(&f->lastTime);
+  }
+}
+
+/* stores the stream file of a flow in the DB and evicts the flow */
+void flow_finish(struct flow *f) {
+  struct partition *p = f->partition;
+
+  flow_write_times(f);
+  if (f->ip_p == IPPROTO_UDP) {
+    Udp4Stream_setData(to_streamfile_path(f->streamId));
+  } else {
+    Ip4Stream_setData(to_streamfile_path(f->streamId));
+  }
+  index_payload(f->streamId);
+  Util_newFlowSummary(f->streamId, f->ip_p, f->id, 0, &f->counters, -1);
+
+  if (sink == SINK_H2) {
+    Util_evict(f->object);
+    (*jni)->DeleteGlobalRef(jni, f->object);
+  }
+
+  flow_remove(f);
+  partition_release(p);
+}
+
+/* finishes all flows idle for longer than flowtimeout at the time now */
+void expire_flows(struct timeval *now) {
+  struct flow *f;
+
+  if (flowtimeout == 0) {
+    return;
+  }
+  while ((f = flows.oldest) != NULL && now->tv_sec - f->lastTime.tv_sec > flowtimeout) {
+    debugf("flow (proto = %u, ip4StreamId = %u) idle since %lu, finishing it", f->ip_p, f->streamId, (unsigned long) f->lastTime.tv_sec);
+    flow_finish(f);
+  }
+}
+
+void finish_all_flows() {
+  while (flows.oldest != NULL) {
+    flow_finish(flows.oldest);
+  }
+  free(flows.buckets);
+}
+
+
+/* application layer
+
+   Parsers for the payload of a few protocols. They store what is usually looked for in records of their own, linked
+   to the stream and the number of the StreamSegment the message starts in: the request line and the Host and
+   User-Agent headers of HTTP requests (HttpRequest), the server name of TLS ClientHellos (TlsClientHello) and the
+   questions and answers of DNS messages over UDP port 53 (DnsRecord). TCP connections are parsed in the client to
+   server direction only, on the data reassembled by libnids before the payload cap applies. The protocol of a
+   connection is told by its first data. Strings are stored as printable ASCII, other bytes are replaced by '?'. */
+
+#define APP_MAX_HEADER 8192 // longest HTTP request header parsed
+#define APP_MAX_RECORD (5 + 16384) // longest TLS record
+#define APP_MAX_STRING 2048
+
+enum appprotocol {
+  APP_UNKNOWN, // no data yet
+  APP_HTTP,
+  APP_TLS,
+  APP_NONE // none of the above, or nothing more to parse
+};
+
+/* parser state of the output stream of a TCP connection */
+struct appstate {
+  enum appprotocol protocol;
+  int resync; // HTTP: the next request is only looked for at the start of a segment
+  long skip; // HTTP: bytes of a request body still to skip
+  u_char *buf; // the start of a message received so far, NULL if there is none
+  int len;
+  long segment; // the segment the message starts in
+  struct timeval time;
+  long lastSegment; // the segment of the last record stored and its number in it
+  int lastNumber;
+};
+
+long httprequests = 0;
+
+const char *http_methods[] = {"GET ", "POST ", "HEAD ", "PUT ", "DELETE ", "OPTIONS ", "CONNECT ", "PATCH ", "TRACE ",
+			      NULL};
+
+/* copies len bytes of src into dst as printable ASCII, truncated to size - 1 bytes */
+char *app_string(char *dst, int size, const u_char *src, int len) {
+  int i;
+
+  if (len > size - 1) {
+    len = size - 1;
+  }
+  for (i = 0; i < len; i++) {
+    dst[i] = src[i] >= 0x20 && src[i] < 0x7f ? src[i] : '?';
+  }
+  dst[len] = '\0';
+  return dst;
+}
+
+/* returns the number of the next record starting in segment */
+int app_number(struct appstate *st, long segment) {
+  if (st->lastSegment != segment) {
+    st->lastSegment = segment;
+    st->lastNumber = 0;
+  }
+  return ++st->lastNumber;
+}
+
+void app_drop(struct appstate *st) {
+  free(st->buf);
+  st->buf = NULL;
+  st->len = 0;
+}
+
+/* appends to the message received so far, drops it and returns 0 if it would get longer than max */
+int app_buffer(struct appstate *st, const u_char *data, int len, int max) {
+  u_char *buf;
+
+  if (st->len + len > max) {
+    app_drop(st);
+    return 0;
+  }
+  buf = realloc(st->buf, st->len + len + 1);
+  if (buf == NULL) {
+    die("out of memory");
+  }
+  memcpy(buf + st->len, data, len);
+  st->buf = buf;
+  st->len += len;
+  return 1;
+}
+
+/* tells whether data starts with an HTTP request, a short segment only has to start like one */
+int http_request_start(const u_char *data, int len) {
+  const char **m;
+  int n;
+
+  for (m = http_methods; *m != NULL; m++) {
+    n = strlen(*m);
+    if (memcmp(data, *m, len < n ? len : n) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* returns the length of the HTTP request header in data up to and including the empty line, searching from from,
+   -1 if it is incomplete. Like the other lines, the empty line may end with a bare LF. */
+int http_header_end(const u_char *data, int from, int len) {
+  const u_char *p = data + from;
+
+  while ((p = memchr(p, '\n', data + len - p)) != NULL) {
+    if (p + 1 < data + len && p[1] == '\n') {
+      return p + 2 - data;
+    }
+    if (p + 2 < data + len && p[1] == '\r' && p[2] == '\n') {
+      return p + 3 - data;
+    }
+    p++;
+  }
+  return -1;
+}
+
+/* stores the HTTP request whose header are the first len bytes of msg, returns the length of its body, -1 if it is
+   unknown */
+long http_request(struct appstate *st, int streamId, const u_char *msg, int len) {
+  char method[16], uri[APP_MAX_STRING], version[16], host[256], userAgent[512], value[32];
+  const u_char *end = msg + len;
+  const u_char *line, *eol, *sp1, *sp2, *colon, *v;
+  int n, namelen, chunked = 0;
+  long body = 0;
+
+  host[0] = userAgent[0] = '\0';
+
+  /* the request line: method SP uri SP version */
+  eol = memchr(msg, '\n', len);
+  n = eol - msg;
+  if (n > 0 && msg[n - 1] == '\r') {
+    n--;
+  }
+  sp1 = memchr(msg, ' ', n);
+  if (sp1 == NULL) {
+    return -1;
+  }
+  app_string(method, sizeof(method), msg, sp1 - msg);
+  sp2 = memchr(sp1 + 1, ' ', msg + n - (sp1 + 1));
+  if (sp2 == NULL) {
+    sp2 = msg + n;
+  }
+  app_string(uri, sizeof(uri), sp1 + 1, sp2 - (sp1 + 1));
+  app_string(version, sizeof(version), sp2 < msg + n ? sp2 + 1 : sp2, msg + n - (sp2 < msg + n ? sp2 + 1 : sp2));
+
+  for (line = eol + 1; line < end && (eol = memchr(line, '\n', end - line)) != NULL; line = eol + 1) {
+    n = eol - line;
+    if (n > 0 && line[n - 1] == '\r') {
+      n--;
+    }
+    colon = memchr(line, ':', n);
+    if (colon == NULL) {
+      continue;
+    }
+    namelen = colon - line;
+    for (v = colon + 1; v < line + n && (*v == ' ' || *v == '\t'); v++);
+
+    if (namelen == 4 && strncasecmp((const char *) line, "host", 4) == 0) {
+      app_string(host, sizeof(host), v, line + n - v);
+    } else if (namelen == 10 && strncasecmp((const char *) line, "user-agent", 10) == 0) {
+      app_string(userAgent, sizeof(userAgent), v, line + n - v);
+    } else if (namelen == 14 && strncasecmp((const char *) line, "content-length", 14) == 0) {
+      body = strtol(app_string(value, sizeof(value), v, line + n - v), NULL, 10);
+    } else if (namelen == 17 && strncasecmp((const char *) line, "transfer-encoding", 17) == 0) {
+      chunked = strstr(app_string(value, sizeof(value), v, line + n - v), "chunked") != NULL;
+    }
+  }
+
+  httprequests++;
+  Util_newHttpRequest(streamId, st->segment, app_number(st, st->segment), &st->time, method, uri,
+		      version[0] != '\0' ? version : NULL, host[0] != '\0' ? host : NULL,
+		      userAgent[0] != '\0' ? userAgent : NULL);
+  return chunked || body < 0 ? -1 : body;
+}
+
+/* parses the requests in new data of the output stream of an HTTP connection. After a request whose body length is
+   unknown (chunked) or anything not looking like a request, the next one is looked for at the start of a segment. */
+void app_http(struct appstate *st, int streamId, const u_char *data, int len, long segment) {
+  int start = 1; // at the start of the segment
+  int end, old, n;
+  long body;
+
+  while (len > 0) {
+    if (st->skip > 0) {
+      n = len < st->skip ? len : st->skip;
+      st->skip -= n;
+      data += n;
+      len -= n;
+      start = 0;
+      continue;
+    }
+
+    if (st->buf == NULL) {
+      /* a new request */
+      if ((st->resync && !start) || !http_request_start(data, len)) {
+	st->resync = 1;
+	return;
+      }
+      st->resync = 0;
+      st->segment = segment;
+      st->time = nids_last_pcap_header->ts;
+      end = http_header_end(data, 0, len);
+      if (end == -1) {
+	if (!app_buffer(st, data, len, APP_MAX_HEADER)) {
+	  st->resync = 1;
+	}
+	return;
+      }
+      body = http_request(st, streamId, data, end);
+    } else {
+      /* the rest of a request header */
+      old = st->len;
+      n = len < APP_MAX_HEADER - old ? len : APP_MAX_HEADER - old;
+      app_buffer(st, data, n, APP_MAX_HEADER);
+      end = http_header_end(st->buf, old > 2 ? old - 2 : 0, st->len);
+      if (end == -1) {
+	if (st->len == APP_MAX_HEADER) {
+	  app_drop(st);
+	  st->resync = 1;
+	}
+	return;
+      }
+      body = http_request(st, streamId, st->buf, end);
+      end -= old;
+      app_drop(st);
+    }
+
+    data += end;
+    len -= end;
+    start = 0;
+    if (body < 0) {
+      st->resync = 1;
+      return;
+    }
+    st->skip = body;
+  }
+}
+
+/* stores the server name of the ClientHello in the TLS record rec of length len */
+void tls_client_hello(struct appstate *st, int streamId, const u_char *rec, int len) {
+  const u_char *p = rec + 5, *end = rec + len, *ext, *extend;
+  char serverName[256];
+  int version, n, type, found = 0;
+
+  /* handshake header: type 1 (ClientHello), 24 bit length */
+  if (p + 4 > end || p[0] != 1) {
+    return;
+  }
+  n = (p[1] << 16) | (p[2] << 8) | p[3];
+  p += 4;
+  if (p + n < end) {
+    end = p + n;
+  }
+
+  /* client_version, random, session_id, cipher_suites, compression_methods */
+  if (p + 2 + 32 + 1 > end) {
+    return;
+  }
+  version = (p[0] << 8) | p[1];
+  p += 2 + 32;
+  p += 1 + p[0];
+  if (p + 2 > end) {
+    return;
+  }
+  p += 2 + ((p[0] << 8) | p[1]);
+  if (p + 1 > end) {
+    return;
+  }
+  p += 1 + p[0];
+
+  /* extensions, server_name is type 0 holding a list of names of which host_name is type 0 */
+  if (p + 2 <= end) {
+    p += 2;
+    while (!found && p + 4 <= end) {
+      type = (p[0] << 8) | p[1];
+      n = (p[2] << 8) | p[3];
+      ext = p + 4;
+      p = ext + n;
+      if (p > end) {
+	break;
+      }
+      if (type != 0 || n < 2) {
+	continue;
+      }
+      extend = ext + 2 + ((ext[0] << 8) | ext[1]);
+      if (extend > p) {
+	extend = p;
+      }
+      for (ext += 2; !found && ext + 3 <= extend; ext += 3 + n) {
+	n = (ext[1] << 8) | ext[2];
+	if (ext + 3 + n > extend) {
+	  break;
+	}
+	if (ext[0] == 0) {
+	  app_string(serverName, sizeof(serverName), ext + 3, n);
+	  found = 1;
+	}
+      }
+    }
+  }
+
+  Util_newTlsClientHello(streamId, st->segment, app_number(st, st->segment), &st->time, version,
+			 found ? serverName : NULL);
+}
+
+/* parses the first record of the output stream of a TLS connection */
+void app_tls(struct appstate *st, int streamId, const u_char *data, int len, long segment) {
+  const u_char *rec;
+  int reclen;
+
+  if (st->buf == NULL) {
+    st->segment = segment;
+    st->time = nids_last_pcap_header->ts;
+    rec = data;
+    reclen = len;
+  } else {
+    app_buffer(st, data, len < APP_MAX_RECORD - st->len ? len : APP_MAX_RECORD - st->len, APP_MAX_RECORD);
+    rec = st->buf;
+    reclen = st->len;
+  }
+
+  if (reclen >= 5 && reclen >= 5 + ((rec[3] << 8) | rec[4])) {
+    tls_client_hello(st, streamId, rec, 5 + ((rec[3] << 8) | rec[4]));
+    st->protocol = APP_NONE;
+  } else if (reclen >= APP_MAX_RECORD) {
+    st->protocol = APP_NONE;
+  } else if (st->buf == NULL) {
+    app_buffer(st, data, len, APP_MAX_RECORD);
+    return;
+  } else {
+    return;
+  }
+  app_drop(st);
+}
+
+/* parses new data of the output stream of a TCP connection, which starts in the given segment */
+void app_tcp(struct appstate *st, int streamId, const u_char *data, int len, long segment) {
+  if (st->protocol == APP_UNKNOWN) {
+    if (http_request_start(data, len)) {
+      st->protocol = APP_HTTP;
+    } else if (data[0] == 0x16 && (len < 2 || data[1] == 3)) { // handshake record of SSL 3.0 or TLS
+      st->protocol = APP_TLS;
+    } else {
+      st->protocol = APP_NONE;
+    }
+  }
+
+  switch (st->protocol) {
+  case APP_HTTP:
+    app_http(st, streamId, data, len, segment);
+    break;
+  case APP_TLS:
+    app_tls(st, streamId, data, len, segment);
+    break;
+  default:
+    break;
+  }
+}
+
+/* reads the possibly compressed name at off in the DNS message msg into name, returns the offset after the name or
+   -1 if it is invalid */
+int dns_name(const u_char *msg, int len, int off, char *name, int size) {
+  int pos = off, next = -1, jumps = 0, n = 0, l;
+
+  while (1) {
+    if (pos >= len) {
+      return -1;
+    }
+    l = msg[pos];
+    if (l == 0) {
+      pos++;
+      break;
+    }
+    if ((l & 0xc0) == 0xc0) {
+      /* pointer to an earlier name */
+      if (pos + 1 >= len || ++jumps > 32) {
+	return -1;
+      }
+      if (next == -1) {
+	next = pos + 2;
+      }
+      pos = ((l & 0x3f) << 8) | msg[pos + 1];
+      continue;
+    }
+    if ((l & 0xc0) != 0 || pos + 1 + l > len) {
+      return -1;
+    }
+    if (n > 0 && n < size - 1) {
+      name[n++] = '.';
+    }
+    app_string(name + n, size - n, msg + pos + 1, l);
+    n += strlen(name + n);
+    pos += 1 + l;
+  }
+
+  if (n == 0) {
+    strcpy(name, "."); // the root
+  }
+  name[size - 1] = '\0';
+  return next != -1 ? next : pos;
+}
+
+/* stores the questions and answers of the DNS message in a UDP payload */
+void dns_message(int streamId, long segment, const u_char *msg, int len) {
+  char name[256], data[256];
+  int id, response, rcode, questions, answers, type, rdlen, off = 12, number = 0, i;
+  const char *value;
+
+  if (len < 12) {
+    return;
+  }
+  id = (msg[0] << 8) | msg[1];
+  response = msg[2] >> 7;
+  rcode = msg[3] & 0x0f;
+  questions = (msg[4] << 8) | msg[5];
+  answers = (msg[6] << 8) | msg[7];
+
+  for (i = 0; i < questions; i++) {
+    off = dns_name(msg, len, off, name, sizeof(name));
+    if (off == -1 || off + 4 > len) {
+      return;
+    }
+    type = (msg[off] << 8) | msg[off + 1];
+    off += 4;
+    Util_newDnsRecord(streamId, segment, ++number, &nids_last_pcap_header->ts, id, response, rcode, 0, name, type,
+		      NULL);
+  }
+
+  for (i = 0; i < answers; i++) {
+    off = dns_name(msg, len, off, name, sizeof(name));
+    if (off == -1 || off + 10 > len) {
+      return;
+    }
+    type = (msg[off] << 8) | msg[off + 1];
+    rdlen = (msg[off + 8] << 8) | msg[off + 9];
+    off += 10;
+    if (off + rdlen > len) {
+      return;
+    }
+
+    value = NULL;
+    if (type == 1 && rdlen == 4) { // A
+      value = inet_ntop(AF_INET, msg + off, data, sizeof(data));
+    } else if (type == 28 && rdlen == 16) { // AAAA
+      value = inet_ntop(AF_INET6, msg + off, data, sizeof(data));
+    } else if (type == 2 || type == 5 || type == 12) { // NS, CNAME, PTR
+      value = dns_name(msg, len, off, data, sizeof(data)) != -1 ? data : NULL;
+    } else if (type == 15 && rdlen > 2) { // MX
+      value = dns_name(msg, len, off + 2, data, sizeof(data)) != -1 ? data : NULL;
+    }
+    Util_newDnsRecord(streamId, segment, ++number, &nids_last_pcap_header->ts, id, response, rcode, 1, name, type,
+		      value);
+    off += rdlen;
+  }
+}
+
+
+/* open TCP connections
+
+   libnids keeps a pointer to the struct connection of each connection in its user pointer. The open connections are
+   also linked in a list, so that they can be written to checkpoints. */
+
+struct connection {
+  struct connection *prev;
+  struct connection *next; // also links the free connections
+  struct partition *partition;
+  jobject object; // global reference to the Tcp4Connection entity object with H2
+  int id; // Tcp4Connection id
+  int outStreamId;
+  int inStreamId;
+  int outFd; // stream files held open by spool(), -1 if not
+  int inFd;
+  long outStored; // bytes written to the stream files
+  long inStored;
+  long outSegments; // number of StreamSegment records
+  long inSegments;
+  int outTagState; // of the automaton matching the tag patterns
+  int inTagState;
+  /* written to the records when the connection is finished or at a checkpoint, unset until the first data */
+  struct timeval lastTime;
+  struct timeval outLastTime;
+  struct timeval inLastTime;
+  struct counters counters;
+  struct appstate app;
+};
+
+#define CONNECTION_SLAB 1024
+
+struct connection *connections = NULL;
+u_int connectioncount = 0;
+u_int peakconnections = 0;
+/* closed connections for reuse, they are allocated in slabs and never given back */
+struct connection *freeconnections = NULL;
+
+struct connection *connection_alloc() {
+  struct connection *c;
+  int i;
+
+  if (freeconnections == NULL) {
+    c = malloc(CONNECTION_SLAB * sizeof(struct connection));
+    if (c == NULL) {
+      die("out of memory");
+    }
+    for (i = 0; i < CONNECTION_SLAB; i++) {
+      c[i].next = freeconnections;
+      freeconnections = &c[i];
+    }
+  }
+  c = freeconnections;
+  freeconnections = c->next;
+  memset(c, 0, sizeof(struct connection));
+  return c;
+}
+
+/* opens a connection stored in the current partition for the current Tcp4Connection, taking over its object */
+struct connection *connection_open(int id, int outStreamId, int inStreamId) {
+  struct connection *c;
+
+  c = connection_alloc();
+  c->partition = partition;
+  c->partition->refs++;
+  c->object = globalref(Tcp4Connection.object);
+  c->id = id;
+  c->outStreamId = outStreamId;
+  c->inStreamId = inStreamId;
+  c->outFd = -1;
+  c->inFd = -1;
+  if (++connectioncount > peakconnections) {
+    peakconnections = connectioncount;
+  }
+
+  c->next = connections;
+  if (connections != NULL) {
+    connections->prev = c;
+  }
+  connections = c;
+
+  return c;
+}
+
+/* makes the connection's Tcp4Connection the current one */
+void connection_use(struct connection *c) {
+  use_partition(c->partition);
+  Tcp4Connection.object = c->object;
+  Tcp4Connection.id = c->id;
+  Tcp4Connection.outStreamId = c->outStreamId;
+  Tcp4Connection.inStreamId = c->inStreamId;
+}
+
+/* writes the times of the last data, which are only kept in the connection while it is open, the connection's
+   Tcp4Connection must be the current one */
+void connection_write_times(struct connection *c) {
+  if (timeset(&c->outLastTime)) {
+    Tcp4Connection_setOutStreamLastTime(&c->outLastTime);
+  }
+  if (timeset(&c->inLastTime)) {
+    Tcp4Connection_setInStreamLastTime(&c->inLastTime);
+  }
+  if (timeset(&c->lastTime)) {
+    Tcp4Connection_setLastTime(&c->lastTime);
+  }
+}
+
+void connection_close(struct connection *c) {
+  app_drop(&c->app);
+  spool_close(&c->outFd);
+  spool_close(&c->inFd);
+  if (sink == SINK_H2) {
+    Util_evict(c->object);
+    (*jni)->DeleteGlobalRef(jni, c->object);
+  }
+  if (c->prev != NULL) {
+    c->prev->next = c->next;
+  } else {
+    connections = c->next;
+  }
+  if (c->next != NULL) {
+    c->next->prev = c->prev;
+  }
+  partition_release(c->partition);
+  connectioncount--;
+  c->next = freeconnections;
+  freeconnections = c;
+}
+
+
+/* ingest policy
+
+   Besides the BPF filter handed to libnids, two policies limit what is stored: payload caps stop storing the payload
+   of a stream after a number of bytes (its StreamSegment records are still created with the full lengths, so the
+   metadata stays complete and the data is just truncated) and flow sampling keeps only one out of samplerate flows,
+   chosen by a hash of the addresses, ports and protocol so that the same flows are kept on each run. */
+
+struct caprule {
+  int ip_p; // -1 for any protocol
+  int port; // -1 for any port, matches source or destination port
+  long bytes;
+};
+
+#define MAX_CAPRULES 64
+
+struct caprule caprules[MAX_CAPRULES];
+int n_caprules = 0;
+long samplerate = 1;
+
+/* parses a payload cap of the form <proto>[/<port>]:<bytes>, proto is tcp, udp, any or an IP protocol number */
+int parse_caprule(const char *spec) {
+  struct caprule rule;
+  char proto[16];
+  char *end;
+  const char *p;
+  size_t n;
+
+  if (n_caprules == MAX_CAPRULES) {
+    return -1;
+  }
+
+  n = strcspn(spec, "/:");
+  if (n == 0 || n >= sizeof(proto)) {
+    return -1;
+  }
+  memcpy(proto, spec, n);
+  proto[n] = '\0';
+  if (strcmp(proto, "any") == 0) {
+    rule.ip_p = -1;
+  } else if (strcmp(proto, "tcp") == 0) {
+    rule.ip_p = IPPROTO_TCP;
+  } else if (strcmp(proto, "udp") == 0) {
+    rule.ip_p = IPPROTO_UDP;
+  } else {
+    rule.ip_p = strtol(proto, &end, 10);
+    if (*end != '\0' || rule.ip_p < 0 || rule.ip_p > 255) {
+      return -1;
+    }
+  }
+
+  p = spec + n;
+  rule.port = -1;
+  if (*p == '/') {
+    rule.port = strtol(p + 1, &end, 10);
+    if (end == p + 1 || rule.port < 0 || rule.port > 65535) {
+      return -1;
+    }
+    p = end;
+  }
+
+  if (*p != ':') {
+    return -1;
+  }
+  rule.bytes = strtol(p + 1, &end, 10);
+  if (end == p + 1 || *end != '\0' || rule.bytes < 0) {
+    return -1;
+  }
+
+  caprules[n_caprules++] = rule;
+  return 0;
+}
+
+/* returns the payload cap for a stream, -1 if there is none, the most specific rule wins (a port counts more than
+   the protocol), among equally specific ones the last given */
+long payload_cap(u_int8_t ip_p, u_short source, u_short dest) {
+  int i, score;
+  int best = -1;
+  long cap = -1;
+
+  for (i = 0; i < n_caprules; i++) {
+    if (caprules[i].ip_p != -1 && caprules[i].ip_p != ip_p) {
+      continue;
+    }
+    if (caprules[i].port != -1 && caprules[i].port != source && caprules[i].port != dest) {
+      continue;
+    }
+    score = (caprules[i].ip_p != -1) + 2 * (caprules[i].port != -1);
+    if (score >= best) {
+      best = score;
+      cap = caprules[i].bytes;
+    }
+  }
+  return cap;
+}
+
+/* returns the number of bytes of a chunk to store, given the bytes already stored in the stream */
+int capped_length(long cap, long stored, int len) {
+  if (cap == -1 || stored + len <= cap) {
+    return len;
+  }
+  return stored >= cap ? 0 : (int) (cap - stored);
+}
+
+/* decides whether a flow is sampled, both directions of a flow get the same result */
+int sampled(u_int saddr, u_int daddr, u_short source, u_short dest, u_int8_t ip_p) {
+  struct tuple4 addr;
+  u_int h;
+
+  if (samplerate == 1) {
+    return 1;
+  }
+
+  /* order the endpoints */
+  if (saddr < daddr || (saddr == daddr && source < dest)) {
+    addr.saddr = saddr;
+    addr.daddr = daddr;
+    addr.source = source;
+    addr.dest = dest;
+  } else {
+    addr.saddr = daddr;
+    addr.daddr = saddr;
+    addr.source = dest;
+    addr.dest = source;
+  }
+
+  /* finalize the hash, the low bits of flow_hash() are good enough for buckets but not for sampling */
+  h = flow_hash(&addr, ip_p);
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h % samplerate == 0;
+}
+
+
+/* handshakes
+
+   Packets of a TCP handshake are seen before libnids reports the connection as established, so they are counted in a
+   table of their own, keyed by the addresses and ports of the client, until NIDS_JUST_EST folds them into the
+   connection. Handshakes that never complete are dropped after HANDSHAKE_TIMEOUT seconds, and the oldest ones when
+   the table holds as many as libnids tracks connections (n_tcp_streams), as libnids has then dropped their streams
+   for newer ones, so that a SYN flood does not grow it. Like the streams of libnids, they are not checkpointed. */
+
+#define HANDSHAKE_BUCKETS 65536 // a power of 2
+#define HANDSHAKE_TIMEOUT 120 // longer than the SYN retries of common stacks
+
+struct handshake {
+  struct handshake *next; // in the bucket
+  struct handshake *older;
+  struct handshake *newer;
+  struct tuple4 addr;
+  struct counters counters;
+};
+
+struct handshake **handshakes = NULL;
+struct handshake *oldesthandshake = NULL;
+struct handshake *newesthandshake = NULL;
+u_int handshakecount = 0;
+u_int peakhandshakes = 0;
+
+/* unlinks h from its bucket and the age list, to link it again or to free it */
+void handshake_unlink(struct handshake *h) {
+  struct handshake **p;
+
+  for (p = &handshakes[flow_hash(&h->addr, IPPROTO_TCP) & (HANDSHAKE_BUCKETS - 1)]; *p != h; p = &(*p)->next);
+  *p = h->next;
+  if (h->older != NULL) {
+    h->older->newer = h->newer;
+  } else {
+    oldesthandshake = h->newer;
+  }
+  if (h->newer != NULL) {
+    h->newer->older = h->older;
+  } else {
+    newesthandshake = h->older;
+  }
+}
+
+void handshake_free(struct handshake *h) {
+  handshake_unlink(h);
+  free(h);
+  handshakecount--;
+}
+
+/* counts a packet of a handshake, in says whether it was sent by the server */
+void handshake_count(struct tuple4 *addr, int in) {
+  struct handshake *h;
+  u_int b;
+
+  if (handshakes == NULL) {
+    handshakes = calloc(HANDSHAKE_BUCKETS, sizeof(struct handshake *));
+    if (handshakes == NULL) {
+      die("out of memory");
+    }
+  }
+  while ((h = oldesthandshake) != NULL &&
+	 nids_last_pcap_header->ts.tv_sec - h->counters.lastTime.tv_sec > HANDSHAKE_TIMEOUT) {
+    handshake_free(h);
+  }
+
+  b = flow_hash(addr, IPPROTO_TCP) & (HANDSHAKE_BUCKETS - 1);
+  for (h = handshakes[b]; h != NULL && memcmp(&h->addr, addr, sizeof(struct tuple4)) != 0; h = h->next);
+  if (h != NULL) {
+    handshake_unlink(h);
+  } else {
+    if (handshakecount >= nids_params.n_tcp_streams && oldesthandshake != NULL) {
+      handshake_free(oldesthandshake);
+    }
+    h = calloc(1, sizeof(struct handshake));
+    if (h == NULL) {
+      die("out of memory");
+    }
+    h->addr = *addr;
+    h->counters.firstTime = nids_last_pcap_header->ts;
+    if (++handshakecount > peakhandshakes) {
+      peakhandshakes = handshakecount;
+    }
+  }
+  h->next = handshakes[b];
+  handshakes[b] = h;
+  h->older = newesthandshake;
+  h->newer = NULL;
+  if (newesthandshake != NULL) {
+    newesthandshake->newer = h;
+  } else {
+    oldesthandshake = h;
+  }
+  newesthandshake = h;
+
+  if (in) {
+    h->counters.inPackets++;
+  } else {
+    h->counters.outPackets++;
+  }
+  h->counters.lastTime = nids_last_pcap_header->ts;
+}
+
+/* adds the packets of the handshake of a just established connection to its counters */
+void handshake_fold(struct tuple4 *addr, struct counters *counters) {
+  struct handshake *h;
+
+  if (handshakes == NULL) {
+    return;
+  }
+  for (h = handshakes[flow_hash(addr, IPPROTO_TCP) & (HANDSHAKE_BUCKETS - 1)];
+       h != NULL && memcmp(&h->addr, addr, sizeof(struct tuple4)) != 0; h = h->next);
+  if (h == NULL) {
+    return;
+  }
+  counters->firstTime = h->counters.firstTime;
+  counters->outPackets += h->counters.outPackets;
+  counters->inPackets += h->counters.inPackets;
+  handshake_free(h);
+}
 
-  destIp = (*jni)->NewStringUTF(jni, int_ntoa(t3.daddr));
-  e();
-  sourceIp = (*jni)->NewStringUTF(jni, int_ntoa(t3.saddr));
-  e();
-  proto = t3.ip_p;
+/* counts a TCP packet for the summary of its connection, libnids reassembles the payload later on */
+void count_tcp_packet(struct ip *iph) {
+  struct tuple4 addr;
+  struct tcp_stream *a_tcp;
+  struct connection *c;
+  u_char *tcph = (u_char *) iph + iph->ip_hl * 4;
+  u_short *ports = (u_short *) tcph;
+  int in = 0;
+
+  /* up to the flags */
+  if (ntohs(iph->ip_len) < iph->ip_hl * 4 + 14) {
+    return;
+  }
 
-  method = (*jni)->GetMethodID(jni, Util.class, "findIp4Stream", "(Ljava/lang/String;Ljava/lang/String;I)Lpcap2sql/orm/Ip4Stream;");
-  e();
-  
-  res = (*jni)->CallObjectMethod(jni, Util.object, method, destIp, sourceIp, proto);
-  e();
+  /* libnids knows the connection by the addresses and ports of the client */
+  addr.saddr = iph->ip_src.s_addr;
+  addr.daddr = iph->ip_dst.s_addr;
+  addr.source = ntohs(ports[0]);
+  addr.dest = ntohs(ports[1]);
+  a_tcp = nids_find_tcp_stream(&addr);
+  if (a_tcp == NULL) {
+    addr.saddr = iph->ip_dst.s_addr;
+    addr.daddr = iph->ip_src.s_addr;
+    addr.source = ntohs(ports[1]);
+    addr.dest = ntohs(ports[0]);
+    a_tcp = nids_find_tcp_stream(&addr);
+    in = 1;
+  }
 
-  /* delete local references explicitly */
-  (*jni)->DeleteLocalRef(jni, destIp);
-  (*jni)->DeleteLocalRef(jni, sourceIp);
+  /* a SYN opening a new connection, libnids only creates the stream after this callback */
+  if (a_tcp == NULL) {
+    if ((tcph[13] & (TH_SYN | TH_ACK | TH_RST)) == TH_SYN &&
+	sampled(iph->ip_src.s_addr, iph->ip_dst.s_addr, ntohs(ports[0]), ntohs(ports[1]), IPPROTO_TCP)) {
+      addr.saddr = iph->ip_src.s_addr;
+      addr.daddr = iph->ip_dst.s_addr;
+      addr.source = ntohs(ports[0]);
+      addr.dest = ntohs(ports[1]);
+      handshake_count(&addr, 0);
+    }
+    return;
+  }
 
-  return res;
+  /* not established yet, libnids frees the streams of connections not sampled once they are */
+  if (a_tcp->user == NULL) {
+    if (sampled(addr.saddr, addr.daddr, addr.source, addr.dest, IPPROTO_TCP)) {
+      handshake_count(&addr, in);
+    }
+    return;
+  }
+
+  c = a_tcp->user;
+  if (in) {
+    c->counters.inPackets++;
+  } else {
+    c->counters.outPackets++;
+  }
+  c->counters.lastTime = nids_last_pcap_header->ts;
 }
 
-jobject Util_findUdp4Stream(struct tuple4 addr) {
-  jmethodID method;
-  jobject res;
 
-  jstring destIp, sourceIp;
-  jint destPort, sourcePort;
+/* checkpoints
 
-  destIp = (*jni)->NewStringUTF(jni, int_ntoa(addr.daddr));
-  e();
-  sourceIp = (*jni)->NewStringUTF(jni, int_ntoa(addr.saddr));
-  e();
-  destPort = addr.dest;
-  sourcePort = addr.source;
+   Every checkpointinterval packets, the database is committed and the state needed to continue from there is written
+   to the file CHECKPOINT_FILE in the working directory: the sink, the offset in the pcap file, the highest ids, the
+   flow table and the open TCP connections, each with the size of its stream files, its number of segments and the
+   state of the tag automaton in each direction. A final checkpoint is written at the end of each run.
 
-  method = (*jni)->GetMethodID(jni, Util.class, "findUdp4Stream", "(Ljava/lang/String;Ljava/lang/String;II)Lpcap2sql/orm/Udp4Stream;");
-  e();
-  
-  res = (*jni)->CallObjectMethod(jni, Util.object, method, destIp, sourceIp, destPort, sourcePort);
-  e();
+   When pcap2sql is started on a working directory holding a checkpoint, the database and the stream files are rolled
+   back to it and the pcap file is read on from its offset. This resumes an interrupted run, or adds the packets
+   appended to the pcap file since a finished run. libnids' TCP reassembly state cannot be restored, so the
+   connections open at the checkpoint are finished right away with the data received until then, without setting
+   finalStatus, just like on NIDS_EXITING. */
 
-  /* delete local references explicitly */
-  (*jni)->DeleteLocalRef(jni, destIp);
-  (*jni)->DeleteLocalRef(jni, sourceIp);
+#define CHECKPOINT_FILE "checkpoint"
+#define CHECKPOINT_VERSION 4
 
-  return res;
+pcap_t *pcap;
+/* packets between checkpoints, 0 means no periodic checkpoints */
+long checkpointinterval = 0;
+unsigned long packets = 0;
+
+/* appends the counters of a flow or connection to its line */
+void write_counters(FILE *file, struct counters *c) {
+  fprintf(file, " %ld %ld %ld %ld %ld %ld %ld %ld\n", (long) c->firstTime.tv_sec, (long) c->firstTime.tv_usec,
+	  (long) c->lastTime.tv_sec, (long) c->lastTime.tv_usec, c->outPackets, c->outBytes, c->inPackets, c->inBytes);
 }
 
-jobject Util_iterateAllNonTcp4Streams() {
-  jmethodID method;
-  jobject res;
+/* reads the counters appended to a flow or connection line, returns 0 on failure */
+int read_counters(const char *s, struct counters *c) {
+  long sec, usec, lsec, lusec;
 
-  method = (*jni)->GetMethodID(jni, Util.class, "iterateAllNonTcp4Streams", "()Lpcap2sql/orm/Ip4Stream;");
-  e();
-  res = (*jni)->CallObjectMethod(jni, Util.object, method);
-  e();
-  
+  if (sscanf(s, "%ld %ld %ld %ld %ld %ld %ld %ld", &sec, &usec, &lsec, &lusec, &c->outPackets, &c->outBytes,
+	     &c->inPackets, &c->inBytes) != 8) {
+    return 0;
+  }
+  c->firstTime.tv_sec = sec;
+  c->firstTime.tv_usec = usec;
+  c->lastTime.tv_sec = lsec;
+  c->lastTime.tv_usec = lusec;
+  return 1;
+}
+
+/* writes the open partitions, oldest first */
+void write_partitions(FILE *file, struct partition *p) {
+  if (p == NULL) {
+    return;
+  }
+  write_partitions(file, p->next);
+  fprintf(file, "partition %ld %ld %ld\n", (long) p->start, (long) p->startTime.tv_sec, (long) p->startTime.tv_usec);
+}
+
+void write_checkpoint(long offset) {
+  char path[PATH_MAX], tmppath[PATH_MAX];
+  char input[PATH_MAX];
+  FILE *file;
+  struct flow *f;
+  struct connection *c;
+
+  /* the database must not be behind the checkpoint, including the times kept natively */
+  for (f = flows.oldest; f != NULL; f = f->newer) {
+    flow_write_times(f);
+  }
+  for (c = connections; c != NULL; c = c->next) {
+    connection_use(c);
+    connection_write_times(c);
+  }
+  Util_checkpoint();
+
+  strcpy(path, workdir); // workdir is at most PATH_MAX - 64 long
+  strcat(path, "/" CHECKPOINT_FILE);
+  strcpy(tmppath, path);
+  strcat(tmppath, ".tmp");
+  if (realpath(inputfile, input) == NULL) {
+    strncpy(input, inputfile, PATH_MAX);
+  }
+
+  file = fopen(tmppath, "w");
+  if (file == NULL) {
+    logf("failed to open %s for writing: %s", tmppath, strerror(errno));
+    return;
+  }
+
+  fprintf(file, "pcap2sql checkpoint %d\n", CHECKPOINT_VERSION);
+  fprintf(file, "input %s\n", input);
+  fprintf(file, "sink %s\n", sink == SINK_SQLITE ? "sqlite" : "h2");
+  fprintf(file, "offset %ld\n", offset);
+  fprintf(file, "packets %lu\n", packets);
+  fprintf(file, "partitions %ld\n", partitioninterval);
+  if (partitioninterval > 0) {
+    write_partitions(file, partitions);
+  }
+  fprintf(file, "tags %d\n", tagstates);
+  fprintf(file, "ids %d %d %d\n", lastIp4StreamId, lastTcp4ConnectionId, lastUdp4StreamId);
+  /* oldest first, so that the idle list is rebuilt in the same order */
+  for (f = flows.oldest; f != NULL; f = f->newer) {
+    fprintf(file, "flow %u %u %u %u %u %d %d %ld %ld %ld %ld %ld %d %d", f->ip_p, f->addr.saddr, f->addr.daddr,
+	    f->addr.source, f->addr.dest, f->id, f->streamId, (long) f->lastTime.tv_sec, (long) f->lastTime.tv_usec,
+	    f->stored, f->cap, f->segments, f->tagstate, f->partition->index);
+    write_counters(file, &f->counters);
+  }
+  for (c = connections; c != NULL; c = c->next) {
+    fprintf(file, "tcp %d %d %d %ld %ld %ld %ld %d %d %ld %ld %ld %ld %ld %ld %d", c->id, c->outStreamId,
+	    c->inStreamId, c->outStored, c->inStored, c->outSegments, c->inSegments, c->outTagState, c->inTagState,
+	    (long) c->lastTime.tv_sec, (long) c->lastTime.tv_usec, (long) c->outLastTime.tv_sec,
+	    (long) c->outLastTime.tv_usec, (long) c->inLastTime.tv_sec, (long) c->inLastTime.tv_usec, c->partition->index);
+    write_counters(file, &c->counters);
+  }
+  fprintf(file, "end\n");
+
+  /* replace the previous checkpoint atomically */
+  if (fflush(file) != 0 || fsync(fileno(file)) == -1) {
+    logf("failed to write %s: %s", tmppath, strerror(errno));
+    fclose(file);
+    return;
+  }
+  fclose(file);
+  if (rename(tmppath, path) == -1) {
+    logf("failed to rename %s to %s: %s", tmppath, path, strerror(errno));
+    return;
+  }
+  logf("checkpoint written (offset = %ld, packets = %lu, flows = %u)", offset, packets, flows.count);
+}
+
+/* truncates a stream file to the size it had at the checkpoint */
+void truncate_streamfile(int streamId, long size) {
+  if (truncate(to_streamfile_path(streamId), size) == -1) {
+    logf("failed to truncate %s: %s", to_streamfile_path(streamId), strerror(errno));
+  }
+}
+
+/* rolls back to the checkpoint in the working directory, returns the offset to continue reading the pcap file from,
+   0 if there is no checkpoint */
+long resume() {
+  char path[PATH_MAX];
+  char input[PATH_MAX];
+  char line[PATH_MAX + 64];
+  FILE *file;
+  int version = 0;
+  long offset = -1;
+  int complete = 0;
+  struct flow *f;
+  struct connection c;
+  struct tuple4 addr;
+  struct timeval startTime;
+  u_int ip_p, saddr, daddr, source, dest;
+  long sec, usec, osec, ousec, isec, iusec, start, interval;
+  int index, n, states;
+  int tagsvalid = 1;
+
+  strcpy(path, workdir); // workdir is at most PATH_MAX - 64 long
+  strcat(path, "/" CHECKPOINT_FILE);
+  file = fopen(path, "r");
+  if (file == NULL) {
+    if (errno != ENOENT) {
+      logf("FATAL: cannot open %s: %s", path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    return 0;
+  }
+
+  /* check the header lines before touching anything */
+  if (fgets(line, sizeof(line), file) == NULL || sscanf(line, "pcap2sql checkpoint %d", &version) != 1 ||
+      version != CHECKPOINT_VERSION) {
+    die("unsupported checkpoint in the working directory");
+  }
+  if (fgets(line, sizeof(line), file) == NULL || strncmp(line, "input ", 6) != 0) {
+    die("invalid checkpoint in the working directory");
+  }
+  line[strcspn(line, "\n")] = '\0';
+  if (realpath(inputfile, input) == NULL) {
+    strncpy(input, inputfile, PATH_MAX);
+  }
+  if (strcmp(line + 6, input) != 0) {
+    logf("FATAL: the working directory holds a checkpoint of %s, use an empty working directory for %s", line + 6, input);
+    exit(EXIT_FAILURE);
+  }
+  /* the other sink's database would be empty, resuming into it would lose everything before the checkpoint */
+  if (fgets(line, sizeof(line), file) == NULL || strncmp(line, "sink ", 5) != 0) {
+    die("invalid checkpoint in the working directory");
+  }
+  line[strcspn(line, "\n")] = '\0';
+  if (strcmp(line + 5, sink == SINK_SQLITE ? "sqlite" : "h2") != 0) {
+    logf("FATAL: the checkpoint in the working directory was written with -s %s", line + 5);
+    exit(EXIT_FAILURE);
+  }
+
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, "offset %ld", &offset) == 1) {
+      continue;
+    }
+    if (sscanf(line, "packets %lu", &packets) == 1) {
+      continue;
+    }
+    if (sscanf(line, "partitions %ld", &interval) == 1) {
+      if (interval != partitioninterval) {
+	logf("FATAL: the checkpoint in the working directory was written with a partition interval of %ld s", interval);
+	exit(EXIT_FAILURE);
+      }
+      continue;
+    }
+    if (sscanf(line, "tags %d", &states) == 1) {
+      /* the states only mean something to the same automaton, the others start over */
+      if (states != tagstates) {
+	log("the tag patterns differ from those of the checkpoint, matches across it are not found");
+	tagsvalid = 0;
+      }
+      continue;
+    }
+    if (sscanf(line, "partition %ld %ld %ld", &start, &sec, &usec) == 3) {
+      startTime.tv_sec = sec;
+      startTime.tv_usec = usec;
+      partition_open(start, &startTime);
+      continue;
+    }
+    if (sscanf(line, "ids %d %d %d", &lastIp4StreamId, &lastTcp4ConnectionId, &lastUdp4StreamId) == 3) {
+      /* the ids come after the partitions open at the checkpoint and before any flow or connection */
+      logf("rolling back to the checkpoint at offset %ld", offset);
+      if (partitioninterval > 0) {
+	Util_dropPartitionsAfter(partitions != NULL ? partitions->name : "");
+      }
+      Util_rollback(lastIp4StreamId, lastTcp4ConnectionId, lastUdp4StreamId);
+      continue;
+    }
+
+    if (strncmp(line, "flow ", 5) == 0) {
+      f = NULL;
+      if (sscanf(line, "flow %u %u %u %u %u", &ip_p, &saddr, &daddr, &source, &dest) == 5) {
+	addr.saddr = saddr;
+	addr.daddr = daddr;
+	addr.source = source;
+	addr.dest = dest;
+	f = flow_add(&addr, ip_p);
+      }
+      if (f == NULL || sscanf(line, "flow %*u %*u %*u %*u %*u %d %d %ld %ld %ld %ld %ld %d %d%n", &f->id, &f->streamId,
+			      &sec, &usec, &f->stored, &f->cap, &f->segments, &f->tagstate, &index, &n) != 9 ||
+	  !read_counters(line + n, &f->counters) || (f->partition = partition_find(index)) == NULL) {
+	die("invalid flow in the checkpoint");
+      }
+      if (!tagsvalid || f->tagstate < 0 || f->tagstate >= tagstates) {
+	f->tagstate = 0;
+      }
+      f->lastTime.tv_sec = sec;
+      f->lastTime.tv_usec = usec;
+      f->partition->refs++;
+      use_partition(f->partition);
+
+      Util_rollbackIp4Stream(f->streamId, f->segments, &f->lastTime);
+      truncate_streamfile(f->streamId, f->stored);
+
+      /* get the entity object back */
+      if (f->ip_p == IPPROTO_UDP) {
+	Udp4Stream.streamId = f->streamId;
+	if (!Util_findUdp4Stream(f->id)) {
+	  die("flow in the checkpoint not found in the database");
+	}
+	f->object = globalref(Udp4Stream.object);
+      } else {
+	if (!Util_findIp4Stream(f->id)) {
+	  die("flow in the checkpoint not found in the database");
+	}
+	f->object = globalref(Ip4Stream.object);
+      }
+      continue;
+    }
+
+    /* the tag states are read for completeness only, the connection is finished below */
+    if (sscanf(line, "tcp %d %d %d %ld %ld %ld %ld %d %d %ld %ld %ld %ld %ld %ld %d%n", &c.id, &c.outStreamId,
+	       &c.inStreamId, &c.outStored, &c.inStored, &c.outSegments, &c.inSegments, &c.outTagState, &c.inTagState,
+	       &sec, &usec, &osec, &ousec, &isec, &iusec, &index, &n) == 16) {
+      if (!read_counters(line + n, &c.counters) || (c.partition = partition_find(index)) == NULL) {
+	die("invalid connection in the checkpoint");
+      }
+      use_partition(c.partition);
+      c.lastTime.tv_sec = sec;
+      c.lastTime.tv_usec = usec;
+      c.outLastTime.tv_sec = osec;
+      c.outLastTime.tv_usec = ousec;
+      c.inLastTime.tv_sec = isec;
+      c.inLastTime.tv_usec = iusec;
+
+      Util_rollbackIp4Stream(c.outStreamId, c.outSegments, timeset(&c.outLastTime) ? &c.outLastTime : NULL);
+      Util_rollbackIp4Stream(c.inStreamId, c.inSegments, timeset(&c.inLastTime) ? &c.inLastTime : NULL);
+      Util_rollbackTcp4Connection(c.id, timeset(&c.lastTime) ? &c.lastTime : NULL);
+      truncate_streamfile(c.outStreamId, c.outStored);
+      truncate_streamfile(c.inStreamId, c.inStored);
+
+      /* libnids cannot pick the connection up again, finish it like on NIDS_EXITING */
+      logf("finishing TCP connection (id = %u) open at the checkpoint", c.id);
+      if (!Util_findTcp4Connection(c.id)) {
+	die("connection in the checkpoint not found in the database");
+      }
+      Tcp4Connection.outStreamId = c.outStreamId;
+      Tcp4Connection.inStreamId = c.inStreamId;
+      Tcp4Connection_setOutStreamData(to_streamfile_path(c.outStreamId));
+      Tcp4Connection_setInStreamData(to_streamfile_path(c.inStreamId));
+      index_payload(c.outStreamId);
+      index_payload(c.inStreamId);
+      Util_newFlowSummary(c.outStreamId, IPPROTO_TCP, c.id, c.inStreamId, &c.counters, -1);
+      release(Tcp4Connection);
+      c.partition->refs++;
+      partition_release(c.partition);
+      continue;
+    }
+
+    if (strcmp(line, "end\n") == 0) {
+      complete = 1;
+      break;
+    }
+    die("invalid line in the checkpoint");
+  }
+  fclose(file);
+
+  if (!complete || offset < 0) {
+    die("incomplete checkpoint in the working directory");
+  }
+  logf("resuming after %lu packets at offset %ld with %u flows", packets, offset, flows.count);
+  return offset;
+}
+
+
+/* duplicate packets
+
+   Captures from mirrored ports (SPAN) or TAPs often contain packets twice. With -D <ms>, a packet is dropped before
+   libnids sees it if the same IPv4 packet was captured up to ms milliseconds (and at most twice that) before. Packets
+   are compared by a hash of the IP id, addresses, protocol, length and fragment offset and of the IP payload, but not
+   of the TTL and checksum, which a router between the copies changes.
+
+   The hashes are kept in two Bloom filters, one for the current window of ms milliseconds and one for the previous
+   one, which is cleared and becomes the current one when the window ends. Their size is fixed, so a false positive
+   may drop a packet that was not a duplicate: with DEDUP_PROBES probes into DEDUP_BITS bits and 200000 packets in a
+   window, the chance is (1 - e^(-4 * 200000 / 2^24))^4 = 4.7e-6 per filter, below 1e-5 for both. It grows with about
+   the fourth power of the packets per window, from 2e-8 per filter at 50000 to 7e-5 at 400000. */
+
+#define DEDUP_BITS (1 << 24)
+#define DEDUP_PROBES 4
+
+/* milliseconds, 0 means no duplicates are dropped */
+long dedupwindow = 0;
+u_char *dedupfilters[2] = {NULL, NULL}; // current and previous window
+struct timeval dedupstart; // of the current window
+int deduplinktype;
+unsigned long duplicates = 0;
+
+/* returns the IPv4 header of a captured frame and sets *caplen to the bytes captured from it on, NULL if the frame
+   does not hold an IPv4 packet */
+struct ip *frame_ip(const u_char *frame, bpf_u_int32 *caplen) {
+  bpf_u_int32 off;
+  u_int type;
+  struct ip *iph;
+
+  switch (deduplinktype) {
+  case DLT_EN10MB:
+    /* skip VLAN tags */
+    for (off = 12; off + 2 <= *caplen; off += 4) {
+      type = (frame[off] << 8) | frame[off + 1];
+      if (type != 0x8100 && type != 0x88a8 && type != 0x9100) {
+	break;
+      }
+    }
+    if (off + 2 > *caplen || type != 0x0800) {
+      return NULL;
+    }
+    off += 2;
+    break;
+  case DLT_LINUX_SLL:
+    if (*caplen < 16 || ((frame[14] << 8) | frame[15]) != 0x0800) {
+      return NULL;
+    }
+    off = 16;
+    break;
+  case DLT_NULL:
+  case DLT_LOOP:
+    /* the address family in the byte order of the capturing host, or in network byte order */
+    if (*caplen < 4 || (frame[0] != AF_INET && frame[3] != AF_INET)) {
+      return NULL;
+    }
+    off = 4;
+    break;
+  case DLT_RAW:
+#ifdef DLT_IPV4
+  case DLT_IPV4:
+#endif
+    off = 0;
+    break;
+  default:
+    return NULL;
+  }
+
+  iph = (struct ip *) (frame + off);
+  *caplen -= off;
+  if (*caplen < sizeof(struct ip) || iph->ip_v != 4 || iph->ip_hl < 5 || iph->ip_hl * 4 > *caplen) {
+    return NULL;
+  }
+  return iph;
+}
+
+/* mixes len bytes of data into the hash h */
+u_int64_t dedup_hash(u_int64_t h, const u_char *data, bpf_u_int32 len) {
+  u_int64_t v;
+
+  for (; len >= 8; data += 8, len -= 8) {
+    memcpy(&v, data, 8);
+    h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+  }
+  for (; len > 0; data++, len--) {
+    h = (h ^ *data) * 0x100000001b3ULL;
+  }
+  h ^= h >> 32;
+  h *= 0xd6e8feb86659fd93ULL;
+  h ^= h >> 32;
+  return h;
+}
+
+/* tells whether all bits of the hash h are set in filter, and sets them if set is true. The probes are h1 + i * h2
+   (double hashing). */
+int dedup_probe(u_char *filter, u_int64_t h, int set) {
+  u_int32_t bit = h;
+  u_int32_t step = (h >> 32) | 1;
+  int i, found = 1;
+
+  for (i = 0; i < DEDUP_PROBES; i++, bit += step) {
+    if (set) {
+      filter[(bit % DEDUP_BITS) >> 3] |= 1 << (bit & 7);
+    } else if (!(filter[(bit % DEDUP_BITS) >> 3] & (1 << (bit & 7)))) {
+      found = 0;
+    }
+  }
+  return found;
+}
+
+/* tells whether the packet in frame was seen within the window, and records it */
+int duplicate(const struct pcap_pkthdr *header, const u_char *frame) {
+  bpf_u_int32 caplen = header->caplen;
+  struct ip *iph;
+  u_int key[4];
+  u_int64_t h;
+  u_char *previous;
+  long elapsed;
+  int seen;
+
+  /* when the window ends, the current filter becomes the previous one and the previous one is reused cleared */
+  elapsed = (header->ts.tv_sec - dedupstart.tv_sec) * 1000 + (header->ts.tv_usec - dedupstart.tv_usec) / 1000;
+  if (elapsed >= 2 * dedupwindow) {
+    memset(dedupfilters[0], 0, DEDUP_BITS / 8);
+    memset(dedupfilters[1], 0, DEDUP_BITS / 8);
+    dedupstart = header->ts;
+  } else if (elapsed >= dedupwindow) {
+    previous = dedupfilters[1];
+    dedupfilters[1] = dedupfilters[0];
+    dedupfilters[0] = previous;
+    memset(dedupfilters[0], 0, DEDUP_BITS / 8);
+    dedupstart = header->ts;
+  }
+
+  iph = frame_ip(frame, &caplen);
+  if (iph == NULL) {
+    return 0;
+  }
+  /* a total length shorter than the header is bogus, libnids drops such packets anyway */
+  if (ntohs(iph->ip_len) < iph->ip_hl * 4) {
+    return 0;
+  }
+  if (ntohs(iph->ip_len) < caplen) {
+    caplen = ntohs(iph->ip_len);
+  }
+  key[0] = iph->ip_src.s_addr;
+  key[1] = iph->ip_dst.s_addr;
+  key[2] = ((u_int) iph->ip_id << 16) | iph->ip_p;
+  key[3] = ((u_int) iph->ip_len << 16) | iph->ip_off;
+  h = dedup_hash(0, (u_char *) key, sizeof(key));
+  h = dedup_hash(h, (u_char *) iph + iph->ip_hl * 4, caplen - iph->ip_hl * 4);
+
+  seen = dedup_probe(dedupfilters[0], h, 0) || dedup_probe(dedupfilters[1], h, 0);
+  dedup_probe(dedupfilters[0], h, 1);
+  return seen;
+}
+
+void dedup_handler(u_char *user, const struct pcap_pkthdr *header, const u_char *frame) {
+  if (duplicate(header, frame)) {
+    duplicates++;
+    return;
+  }
+  nids_pcap_handler(user, (struct pcap_pkthdr *) header, (u_char *) frame);
+}
+
+/* nids_dispatch(), dropping the duplicates with -D before libnids processes them */
+int dispatch(int cnt) {
+  int res;
+
+  if (dedupwindow == 0) {
+    return nids_dispatch(cnt);
+  }
+  if (dedupfilters[0] == NULL) {
+    dedupfilters[0] = calloc(DEDUP_BITS / 8, 1);
+    dedupfilters[1] = calloc(DEDUP_BITS / 8, 1);
+    if (dedupfilters[0] == NULL || dedupfilters[1] == NULL) {
+      die("out of memory");
+    }
+    deduplinktype = pcap_datalink(pcap);
+  }
+  res = pcap_dispatch(pcap, cnt, dedup_handler, NULL);
+  if (res == -1) {
+    snprintf(nids_errbuf, PCAP_ERRBUF_SIZE, "%s", pcap_geterr(pcap));
+  }
   return res;
 }
 
 
+/* statistics
+
+   Throughput and resource usage of a run, to see how pcap2sql scales on large captures. The JVM heap is sampled every
+   STATS_PACKETS packets, the peaks of the other counters are exact. The statistics are logged when pcap2sql exits, and
+   with -S also written to a file as "<name> <value>" lines, so that runs on the same capture can be compared with an
+   earlier one. Throughput counts only the packets read by this run, not those before a checkpoint resumed from. */
+
+#define STATS_PACKETS 65536
+
+/* file to write the statistics to, none if NULL */
+char *statsfile = NULL;
+struct timeval starttime;
+unsigned long startpackets = 0;
+long startoffset = 0;
+long peakheap = -1; // bytes, -1 with SQLite
+
+void stats_sample() {
+  long heap;
+
+  if (sink == SINK_H2) {
+    heap = jvm_heapused();
+    if (heap > peakheap) {
+      peakheap = heap;
+    }
+  }
+}
+
+/* adds up the number and size of the files in the working directory whose names start with prefix */
+void stats_files(const char *prefix, long *count, long long *bytes) {
+  DIR *dir;
+  struct dirent *entry;
+  struct stat statbuf;
+  char path[PATH_MAX];
+
+  *count = 0;
+  *bytes = 0;
+  dir = opendir(workdir);
+  if (dir == NULL) {
+    logf("cannot list %s: %s", workdir, strerror(errno));
+    return;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (strncmp(entry->d_name, prefix, strlen(prefix)) != 0 || strlen(entry->d_name) > 62) {
+      continue;
+    }
+    strcpy(path, workdir); // workdir is at most PATH_MAX - 64 long
+    strcat(path, "/");
+    strcat(path, entry->d_name);
+    if (stat(path, &statbuf) == 0 && S_ISREG(statbuf.st_mode)) {
+      (*count)++;
+      *bytes += statbuf.st_size;
+    }
+  }
+  closedir(dir);
+}
+
+/* logs the statistics and writes them to statsfile, offset is the one in the pcap file after the last packet */
+void write_stats(long offset) {
+  struct timeval now;
+  struct rusage usage;
+  double elapsed;
+  long streamfiles, dbfiles;
+  long long streambytes, dbbytes;
+  FILE *file;
+  int i;
+
+  gettimeofday(&now, NULL);
+  elapsed = (now.tv_sec - starttime.tv_sec) + (now.tv_usec - starttime.tv_usec) / 1e6;
+  if (elapsed <= 0) {
+    elapsed = 1e-6;
+  }
+  getrusage(RUSAGE_SELF, &usage);
+  stats_files("stream_", &streamfiles, &streambytes);
+  stats_files(DBNAME, &dbfiles, &dbbytes);
+
+  struct {
+    const char *name;
+    double value;
+  } stats[] = {
+    {"elapsed_s", elapsed},
+    {"packets", packets - startpackets},
+    {"packets_per_s", (packets - startpackets) / elapsed},
+    {"input_bytes", offset - startoffset},
+    {"input_mib_per_s", (offset - startoffset) / elapsed / (1 << 20)},
+    {"ip4streams", lastIp4StreamId},
+    {"tcp4connections", lastTcp4ConnectionId},
+    {"udp4streams", lastUdp4StreamId},
+    {"peak_flows", peakflows},
+    {"peak_handshakes", peakhandshakes},
+    {"peak_connections", peakconnections},
+    {"peak_held_streamfiles", peakspoolfds},
+    {"payload_tags", tagcount},
+    {"http_requests", httprequests},
+    {"duplicates", duplicates},
+    {"peak_rss_kib", usage.ru_maxrss},
+    {"peak_jvm_heap_kib", peakheap >= 0 ? peakheap / 1024 : -1},
+    {"streamfiles", streamfiles},
+    {"streamfile_bytes", streambytes},
+    {"db_files", dbfiles},
+    {"db_bytes", dbbytes},
+  };
+
+  for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+    logf("statistics: %s = %.15g", stats[i].name, stats[i].value);
+  }
+
+  if (statsfile == NULL) {
+    return;
+  }
+  file = fopen(statsfile, "w");
+  if (file == NULL) {
+    logf("failed to open %s for writing: %s", statsfile, strerror(errno));
+    return;
+  }
+  for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+    fprintf(file, "%s %.15g\n", stats[i].name, stats[i].value);
+  }
+  fclose(file);
+}
+
+
 /* callback funtions */
 
 void ip4_callback(struct ip *a_packet, int len) {
-  int fd, id, res;
+  int id, res;
   struct tuple3 t3;
-  char tuple3string[64];
+  struct tuple4 addr;
+  struct flow *f;
   int headerlen, payloadlen;
 
-  /* no TCP or UDP */
-  if (a_packet->ip_p == IPPROTO_TCP || a_packet->ip_p == IPPROTO_UDP) {
+  /* this callback sees every packet, so the idle timeout of UDP and raw IP flows is driven from here */
+  expire_flows(&(nids_last_pcap_header->ts));
+
+  /* no TCP or UDP, TCP packets are just counted */
+  if (a_packet->ip_p == IPPROTO_TCP) {
+    count_tcp_packet(a_packet);
+    return;
+  }
+  if (a_packet->ip_p == IPPROTO_UDP) {
     return;
   }
 
@@ -618,70 +4075,99 @@ void ip4_callback(struct ip *a_packet, int len) {
   t3.daddr = *((u_int *) &a_packet->ip_dst);
   t3.ip_p = a_packet->ip_p;
 
-  strncpy(tuple3string, to_tuple3string(t3), sizeof(tuple3string)); // hold it locally
+  if (!sampled(t3.saddr, t3.daddr, 0, 0, t3.ip_p)) {
+    return;
+  }
 
-  /* instantiate a new persistent object or get already stored one for this tuple3 */
-  Ip4Stream.object = Util_findIp4Stream(t3);
-  if (Ip4Stream.object == NULL) {
-    logf("%s object not found in database, instantiating a new one", tuple3string);
-    Ip4Stream.object = Util_newIp4Stream(t3, &(nids_last_pcap_header->ts));
-    logf("%s object successfuly instantiated (id = %u)", tuple3string, Ip4Stream_getId());
+  addr.saddr = t3.saddr;
+  addr.daddr = t3.daddr;
+  addr.source = 0;
+  addr.dest = 0;
+
+  /* instantiate a new persistent object or get the one of the active flow for this tuple3 */
+  f = flow_find(&addr, t3.ip_p);
+  if (f == NULL) {
+    debugf("%s no active flow, instantiating a new object", to_tuple3string(t3));
+    use_partition(partition_for(&(nids_last_pcap_header->ts)));
+    Util_newIp4Stream(t3, &(nids_last_pcap_header->ts));
+    f = flow_add(&addr, t3.ip_p);
+    f->partition = partition;
+    f->partition->refs++;
+    f->id = f->streamId = Ip4Stream_getId();
+    f->object = globalref(Ip4Stream.object);
+    f->counters.firstTime = nids_last_pcap_header->ts;
+    f->cap = payload_cap(t3.ip_p, 0, 0);
+    lastIp4StreamId = f->streamId;
+    create_streamfile(f->streamId);
+    debugf("%s object successfuly instantiated (id = %u)", to_tuple3string(t3), f->id);
   } else {
-    logf("%s object found in database, (id = %u)", tuple3string, Ip4Stream_getId());
+    debugf("%s active flow found, (id = %u)", to_tuple3string(t3), f->id);
+    use_partition(f->partition);
   }
+  Ip4Stream.object = f->object;
+  Ip4Stream.id = f->id;
 
-  id = Ip4Stream_getId();
+  id = f->id;
 
   headerlen = a_packet->ip_hl * 4;
   payloadlen = ntohs(a_packet->ip_len) - headerlen;
 
-  /* dump payload to file */
-  fd = open_streamfile(id);
-  if (fd != -1) {
-    res = write(fd, (void *) a_packet + headerlen, payloadlen);
-    if (res != -1) {
-      logf("%s (id = %u) written %u bytes to %s", tuple3string, id, payloadlen, to_streamfile_path(id));
-      /* creating new StreamSegment record, if new data is successfully written */
-      Ip4Stream_addStreamSegment(payloadlen, &nids_last_pcap_header->ts);
-    }
-    close(fd);
+  /* dump payload to file, up to the payload cap */
+  res = spool(NULL, id, (void *) a_packet + headerlen, capped_length(f->cap, f->stored, payloadlen));
+  if (res != -1) {
+    f->stored += res;
+    debugf("%s (id = %u) written %u of %u bytes to %s", to_tuple3string(t3), id, res, payloadlen, to_streamfile_path(id));
+    /* creating new StreamSegment record, if new data is successfully written */
+    f->segments++;
+    Ip4Stream_addStreamSegment(f->segments, f->counters.outBytes, payloadlen, &nids_last_pcap_header->ts);
+    tag_payload(&f->tagstate, id, f->segments, f->counters.outBytes, (u_char *) a_packet + headerlen, payloadlen);
   }
-  /* further error handling in open_streamfile() */
+  /* further error handling in spool() */
 
-  /* finally, set lastTime */
-  Ip4Stream_setLastTime(&(nids_last_pcap_header->ts));
+  /* finally, set lastTime, it is written when the flow is finished */
+  f->lastTime = nids_last_pcap_header->ts;
+  f->counters.lastTime = nids_last_pcap_header->ts;
+  f->counters.outPackets++;
+  f->counters.outBytes += payloadlen;
 
   // DEBUG
   // hexdump((void *) a_packet + headerlen, payloadlen);
 
-  /* delete local references explicitly */
-  (*jni)->DeleteLocalRef(jni, Ip4Stream.object);
+  /* the flow holds a global reference to the object, nothing to delete */
 
   return;
 }
 
-void tcp4_callback(struct tcp_stream *a_tcp, int **id) {
+void tcp4_callback(struct tcp_stream *a_tcp, struct connection **conn) {
   int streamId;
-  char tuple4string[64];
-  int fd;
 
-  strncpy(tuple4string, to_tuple4string(a_tcp->addr), sizeof(tuple4string)); // hold it locally
-
-  /* in this case the actual connection's persistent object should already exist */
+  /* in this case the actual connection's persistent object should already exist, the connection holds it */
   if (a_tcp->nids_state != NIDS_JUST_EST) {
-    Tcp4Connection.object = Util_findTcp4Connection(**id);
+    connection_use(*conn);
   }
 
   /* newly established connection */
   if (a_tcp->nids_state == NIDS_JUST_EST) {
 
+    /* not sampled: don't collect any data, then libnids doesn't call us again for this connection */
+    if (!sampled(a_tcp->addr.saddr, a_tcp->addr.daddr, a_tcp->addr.source, a_tcp->addr.dest, IPPROTO_TCP)) {
+      debugf("NIDS_JUST_EST: %s not sampled, ignoring it", to_tuple4string(a_tcp->addr));
+      return;
+    }
+
     /* instantiate new a Tcp4Connection object */    
-    logf("NIDS_JUST_EST: %s instantiating new object", tuple4string);
-    Tcp4Connection.object = Util_newTcp4Connection(a_tcp->addr, &(nids_last_pcap_header->ts));
-    /* libnids gives us a unique pointer to a custom location, retain persistent object's id there */
-    *id =  (int *) malloc(sizeof(int));
-    **id = Tcp4Connection_getId();
-    logf("NIDS_JUST_EST: %s object successfuly instantiated (id = %u, outStreamId = %u, inStreamId = %u)", tuple4string, **id, Tcp4Connection_getOutStreamId(), Tcp4Connection_getInStreamId());
+    debugf("NIDS_JUST_EST: %s instantiating new object", to_tuple4string(a_tcp->addr));
+    use_partition(partition_for(&(nids_last_pcap_header->ts)));
+    Util_newTcp4Connection(a_tcp->addr, &(nids_last_pcap_header->ts));
+    /* libnids gives us a unique pointer to a custom location, retain the open connection there */
+    *conn = connection_open(Tcp4Connection_getId(), Tcp4Connection_getOutStreamId(), Tcp4Connection_getInStreamId());
+    (*conn)->counters.firstTime = (*conn)->counters.lastTime = nids_last_pcap_header->ts;
+    handshake_fold(&a_tcp->addr, &(*conn)->counters);
+    /* for counting the packets in ip4_callback */
+    a_tcp->user = *conn;
+    lastTcp4ConnectionId = (*conn)->id;
+    lastIp4StreamId = (*conn)->outStreamId > (*conn)->inStreamId ? (*conn)->outStreamId : (*conn)->inStreamId;
+    debugf("NIDS_JUST_EST: %s object successfuly instantiated (id = %u, outStreamId = %u, inStreamId = %u)", to_tuple4string(a_tcp->addr), (*conn)->id, (*conn)->outStreamId, (*conn)->inStreamId);
 
     /* set flags to get data */
     a_tcp->client.collect++; // we want data received by a client
@@ -690,22 +4176,13 @@ void tcp4_callback(struct tcp_stream *a_tcp, int **id) {
     //a_tcp->client.collect_urg++; // urgent data received by a client
 
     /* create files for outStreamId and inStreamId data */
-    streamId = Tcp4Connection_getOutStreamId();
-    logf("NIDS_JUST_EST: %s creating file for outStream data", tuple4string);
-    fd = open_streamfile(streamId);
-    if (fd != -1) {
-      close(fd);
-    }
+    debugf("NIDS_JUST_EST: %s creating file for outStream data", to_tuple4string(a_tcp->addr));
+    create_streamfile((*conn)->outStreamId);
 
-    streamId = Tcp4Connection_getInStreamId();
-    logf("NIDS_JUST_EST: %s creating file for inStream data", tuple4string);
-    fd = open_streamfile(streamId);
-    if (fd != -1) {
-      close(fd);
-    }
+    debugf("NIDS_JUST_EST: %s creating file for inStream data", to_tuple4string(a_tcp->addr));
+    create_streamfile((*conn)->inStreamId);
 
-    /* delete local references explicitly */
-    (*jni)->DeleteLocalRef(jni, Tcp4Connection.object);
+    /* the connection holds a global reference to the object, nothing to delete */
 
     return;
   }
@@ -713,20 +4190,23 @@ void tcp4_callback(struct tcp_stream *a_tcp, int **id) {
   /* connection has been closed normally */
   if (a_tcp->nids_state == NIDS_CLOSE) {
     //id = Tcp4Connection_getId();
-    logf("NIDS_CLOSE: %s (id = %u)", tuple4string, **id);
+    debugf("NIDS_CLOSE: %s (id = %u)", to_tuple4string(a_tcp->addr), (*conn)->id);
 
     /* set finalStatus and lastTime */
     Tcp4Connection_setFinalStatus(0);
-    Tcp4Connection_setLastTime(&(nids_last_pcap_header->ts));
+    (*conn)->lastTime = nids_last_pcap_header->ts;
+    connection_write_times(*conn);
 
     /* save streamdump in the DB */
-    streamId = Tcp4Connection_getOutStreamId();
-    Tcp4Connection_setOutStreamData(to_streamfile_path(streamId));
-    streamId = Tcp4Connection_getInStreamId();
-    Tcp4Connection_setInStreamData(to_streamfile_path(streamId));
+    Tcp4Connection_setOutStreamData(to_streamfile_path((*conn)->outStreamId));
+    Tcp4Connection_setInStreamData(to_streamfile_path((*conn)->inStreamId));
+    index_payload((*conn)->outStreamId);
+    index_payload((*conn)->inStreamId);
+    Util_newFlowSummary((*conn)->outStreamId, IPPROTO_TCP, (*conn)->id, (*conn)->inStreamId, &(*conn)->counters, 0);
 
-    /* delete local references explicitly */
-    (*jni)->DeleteLocalRef(jni, Tcp4Connection.object);
+    /* closing the connection deletes its global reference */
+    a_tcp->user = NULL;
+    connection_close(*conn);
 
     return;
   }
@@ -734,27 +4214,31 @@ void tcp4_callback(struct tcp_stream *a_tcp, int **id) {
   /* connection has been closed by RST */
   if (a_tcp->nids_state == NIDS_RESET) {
     //id = Tcp4Connection_getId();
-    logf("NIDS_RESET: %s (id = %u)", tuple4string, **id);
+    debugf("NIDS_RESET: %s (id = %u)", to_tuple4string(a_tcp->addr), (*conn)->id);
 
     /* set finalStatus and lastTime */
     Tcp4Connection_setFinalStatus(1);
-    Tcp4Connection_setLastTime(&(nids_last_pcap_header->ts));
+    (*conn)->lastTime = nids_last_pcap_header->ts;
+    connection_write_times(*conn);
 
     /* save stream dump in the DB */
-    streamId = Tcp4Connection_getOutStreamId();
-    Tcp4Connection_setOutStreamData(to_streamfile_path(streamId));
-    streamId = Tcp4Connection_getInStreamId();
-    Tcp4Connection_setInStreamData(to_streamfile_path(streamId));
+    Tcp4Connection_setOutStreamData(to_streamfile_path((*conn)->outStreamId));
+    Tcp4Connection_setInStreamData(to_streamfile_path((*conn)->inStreamId));
+    index_payload((*conn)->outStreamId);
+    index_payload((*conn)->inStreamId);
+    Util_newFlowSummary((*conn)->outStreamId, IPPROTO_TCP, (*conn)->id, (*conn)->inStreamId, &(*conn)->counters, 1);
 
-    /* delete local references explicitly */
-    (*jni)->DeleteLocalRef(jni, Tcp4Connection.object);
+    /* closing the connection deletes its global reference */
+    a_tcp->user = NULL;
+    connection_close(*conn);
 
     return;
   }
 
   /* new data flows through */
   if (a_tcp->nids_state == NIDS_DATA) {
-    int fd, res;
+    int res;
+    long cap;
     struct half_stream *hlf;
 
     //id = Tcp4Connection_getId();
@@ -766,66 +4250,75 @@ void tcp4_callback(struct tcp_stream *a_tcp, int **id) {
     /*   return; */
     /* } */
 
+    /* the payload cap applies to each direction separately, hlf->count - hlf->count_new bytes of a direction have
+       been received before the new data */
+    cap = payload_cap(IPPROTO_TCP, a_tcp->addr.source, a_tcp->addr.dest);
+
     if (a_tcp->server.count_new) { // data for server
       hlf = &a_tcp->server; // stream out
-      logf("NIDS_DATA: %s (id = %u) %u bytes out", tuple4string, **id, hlf->count_new);
+      debugf("NIDS_DATA: %s (id = %u) %u bytes out", to_tuple4string(a_tcp->addr), (*conn)->id, hlf->count_new);
       /* dump new data file */
-      streamId = Tcp4Connection_getOutStreamId();
-      fd = open_streamfile(streamId);
-      if (fd != -1) {
-	res = write(fd, hlf->data, hlf->count_new);
-	if (res != -1) {
-	  logf("NDIS_DATA: %s (id = %u) written %u bytes to %s", tuple4string, **id, res, to_streamfile_path(streamId));
-	  /* creating new OutStreamSegment record, if new data is successfully written */
-	  Tcp4Connection_addOutStreamSegment(hlf->count_new, &nids_last_pcap_header->ts);
-	}
-	close(fd);
+      streamId = (*conn)->outStreamId;
+      res = spool(&(*conn)->outFd, streamId, hlf->data, capped_length(cap, hlf->count - hlf->count_new, hlf->count_new));
+      if (res != -1) {
+	(*conn)->outStored += res;
+	debugf("NIDS_DATA: %s (id = %u) written %u of %u bytes to %s", to_tuple4string(a_tcp->addr), (*conn)->id, res, hlf->count_new, to_streamfile_path(streamId));
+	/* creating new OutStreamSegment record, if new data is successfully written */
+	(*conn)->outSegments++;
+	Tcp4Connection_addOutStreamSegment((*conn)->outSegments, hlf->count - hlf->count_new, hlf->count_new,
+					   &nids_last_pcap_header->ts);
+	app_tcp(&(*conn)->app, streamId, (u_char *) hlf->data, hlf->count_new, (*conn)->outSegments);
+	tag_payload(&(*conn)->outTagState, streamId, (*conn)->outSegments, hlf->count - hlf->count_new, (u_char *) hlf->data, hlf->count_new);
       }
+      (*conn)->counters.outBytes += hlf->count_new;
       /* set lastTime for stream */
-      Tcp4Connection_setOutStreamLastTime(&(nids_last_pcap_header->ts));
+      (*conn)->outLastTime = nids_last_pcap_header->ts;
     }
     else { // data for client
       hlf = &a_tcp->client; // stream in
-      logf("NIDS_DATA: %s (id = %u) %u bytes in", tuple4string, **id, hlf->count_new);
+      debugf("NIDS_DATA: %s (id = %u) %u bytes in", to_tuple4string(a_tcp->addr), (*conn)->id, hlf->count_new);
       /* dump data to a file */
-      streamId = Tcp4Connection_getInStreamId();
-      fd = open_streamfile(streamId);
-      if (fd != -1) {
-	res = write(fd, hlf->data, hlf->count_new);
-	if (res != -1) {
-	  logf("NDIS_DATA: %s (id = %u) written %u bytes to %s", tuple4string, **id, res, to_streamfile_path(streamId));
-	  /* creating new InStreamSegment record, if new data is successfully written */
-	  Tcp4Connection_addInStreamSegment(hlf->count_new, &nids_last_pcap_header->ts);
-	}
-	close(fd);
+      streamId = (*conn)->inStreamId;
+      res = spool(&(*conn)->inFd, streamId, hlf->data, capped_length(cap, hlf->count - hlf->count_new, hlf->count_new));
+      if (res != -1) {
+	(*conn)->inStored += res;
+	debugf("NIDS_DATA: %s (id = %u) written %u of %u bytes to %s", to_tuple4string(a_tcp->addr), (*conn)->id, res, hlf->count_new, to_streamfile_path(streamId));
+	/* creating new InStreamSegment record, if new data is successfully written */
+	(*conn)->inSegments++;
+	Tcp4Connection_addInStreamSegment((*conn)->inSegments, hlf->count - hlf->count_new, hlf->count_new,
+					  &nids_last_pcap_header->ts);
+	tag_payload(&(*conn)->inTagState, streamId, (*conn)->inSegments, hlf->count - hlf->count_new, (u_char *) hlf->data, hlf->count_new);
       }
+      (*conn)->counters.inBytes += hlf->count_new;
       /* set lastTime for stream */
-      Tcp4Connection_setInStreamLastTime(&(nids_last_pcap_header->ts));
+      (*conn)->inLastTime = nids_last_pcap_header->ts;
     }
 
-    /* finally, set lastTime for connection */
-    Tcp4Connection_setLastTime(&(nids_last_pcap_header->ts));
+    /* finally, set lastTime for connection, the times are written when the connection is finished */
+    (*conn)->lastTime = nids_last_pcap_header->ts;
 
-    /* delete local references explicitly */
-    (*jni)->DeleteLocalRef(jni, Tcp4Connection.object);
+    /* the connection holds a global reference to the object, nothing to delete */
 
     return;
   }
 
   /* unknown connection status, but libnids is exiting, we must save the stream data in the DB */
   if (a_tcp->nids_state == NIDS_EXITING) {
-    logf("NIDS_EXITING: %s (id = %u)", tuple4string, **id);
+    debugf("NIDS_EXITING: %s (id = %u)", to_tuple4string(a_tcp->addr), (*conn)->id);
 
     /* save stream dump in the DB */
-    streamId = Tcp4Connection_getOutStreamId();
-    Tcp4Connection_setOutStreamData(to_streamfile_path(streamId));
-    streamId = Tcp4Connection_getInStreamId();
-    Tcp4Connection_setInStreamData(to_streamfile_path(streamId));
+    Tcp4Connection_setOutStreamData(to_streamfile_path((*conn)->outStreamId));
+    Tcp4Connection_setInStreamData(to_streamfile_path((*conn)->inStreamId));
+    index_payload((*conn)->outStreamId);
+    index_payload((*conn)->inStreamId);
 
-    /* not setting finalStatus and lastTime */
+    /* not setting finalStatus, lastTime is the one of the last data */
+    connection_write_times(*conn);
+    Util_newFlowSummary((*conn)->outStreamId, IPPROTO_TCP, (*conn)->id, (*conn)->inStreamId, &(*conn)->counters, -1);
 
-    /* delete local references explicitly */
-    (*jni)->DeleteLocalRef(jni, Tcp4Connection.object);
+    /* closing the connection deletes its global reference */
+    a_tcp->user = NULL;
+    connection_close(*conn);
 
     return;
   }
@@ -834,64 +4327,173 @@ void tcp4_callback(struct tcp_stream *a_tcp, int **id) {
 }
 
 void udp4_callback(struct tuple4 *addr, char *buf, int len, struct ip *iph) {
-  int fd, id, res;
-  char tuple4string[64];
+  int id, res;
+  struct flow *f;
 
-  strncpy(tuple4string, to_tuple4string(*addr), sizeof(tuple4string)); // hold it locally
+  if (!sampled(addr->saddr, addr->daddr, addr->source, addr->dest, IPPROTO_UDP)) {
+    return;
+  }
 
-  /* instantiate a new entity object or get already stored one for this tuple4 */
-  Udp4Stream.object = Util_findUdp4Stream(*addr);
-  if (Udp4Stream.object == NULL) {
-    logf("%s object not found in database, instantiating a new one", tuple4string);
-    Udp4Stream.object = Util_newUdp4Stream(*addr, &(nids_last_pcap_header->ts));
-    logf("%s object successfuly instantiated (id = %u, streamId = %u)", tuple4string, Udp4Stream_getId(), Udp4Stream_getStreamId());
+  /* instantiate a new entity object or get the one of the active flow for this tuple4 */
+  f = flow_find(addr, IPPROTO_UDP);
+  if (f == NULL) {
+    debugf("%s no active flow, instantiating a new object", to_tuple4string(*addr));
+    use_partition(partition_for(&(nids_last_pcap_header->ts)));
+    Util_newUdp4Stream(*addr, &(nids_last_pcap_header->ts));
+    f = flow_add(addr, IPPROTO_UDP);
+    f->partition = partition;
+    f->partition->refs++;
+    f->id = Udp4Stream_getId();
+    f->streamId = Udp4Stream_getStreamId();
+    f->object = globalref(Udp4Stream.object);
+    f->counters.firstTime = nids_last_pcap_header->ts;
+    f->cap = payload_cap(IPPROTO_UDP, addr->source, addr->dest);
+    lastUdp4StreamId = f->id;
+    lastIp4StreamId = f->streamId;
+    create_streamfile(f->streamId);
+    debugf("%s object successfuly instantiated (id = %u, streamId = %u)", to_tuple4string(*addr), f->id, f->streamId);
   } else {
-    logf("%s object found in database (id = %u, streamId = %u)", tuple4string, Udp4Stream_getId(), Udp4Stream_getStreamId());
+    debugf("%s active flow found (id = %u, streamId = %u)", to_tuple4string(*addr), f->id, f->streamId);
+    use_partition(f->partition);
   }
+  Udp4Stream.object = f->object;
+  Udp4Stream.id = f->id;
+  Udp4Stream.streamId = f->streamId;
 
-  id = Udp4Stream_getStreamId();
+  id = f->streamId;
   
-  /* dump payload to file */
-  fd = open_streamfile(id);
-  if (fd != -1) {
-    res = write(fd, buf, len);
-    if (res != -1) {
-      logf("%s (ip4StreamId = %u) written %u bytes to %s", tuple4string, id, res, to_streamfile_path(id));
-      /* creating new StreamSegment record, if new data is successfully written */
-      Udp4Stream_addStreamSegment(len, &nids_last_pcap_header->ts);
+  /* dump payload to file, up to the payload cap */
+  res = spool(NULL, id, buf, capped_length(f->cap, f->stored, len));
+  if (res != -1) {
+    f->stored += res;
+    debugf("%s (ip4StreamId = %u) written %u of %u bytes to %s", to_tuple4string(*addr), id, res, len, to_streamfile_path(id));
+    /* creating new StreamSegment record, if new data is successfully written */
+    f->segments++;
+    Udp4Stream_addStreamSegment(f->segments, f->counters.outBytes, len, &nids_last_pcap_header->ts);
+    tag_payload(&f->tagstate, id, f->segments, f->counters.outBytes, (u_char *) buf, len);
+    if (addr->source == 53 || addr->dest == 53) {
+      dns_message(f->streamId, f->segments, (u_char *) buf, len);
     }
-    close(fd);
   }
 
-  /* finally, set lastTime */
-  Udp4Stream_setLastTime(&(nids_last_pcap_header->ts));
+  /* finally, set lastTime, it is written when the flow is finished */
+  f->lastTime = nids_last_pcap_header->ts;
+  f->counters.lastTime = nids_last_pcap_header->ts;
+  f->counters.outPackets++;
+  f->counters.outBytes += len;
 
   // DEBUG
   // hexdump((void *) a_packet + headerlen, payloadlen);
 
-  /* delete local references explicitly */
-  (*jni)->DeleteLocalRef(jni, Udp4Stream.object);
+  /* the flow holds a global reference to the object, nothing to delete */
 
   return;
 }
 
 
 int main (int argc, char *argv[]) {
-  int res;
-  char *classpath;
+  int res, opt, i;
+  long offset;
+  char pcaperrbuf[PCAP_ERRBUF_SIZE];
+  char *classpath = NULL;
+  char *filter = NULL;
   char *pathbuf;
   struct stat statbuf;
+  struct rlimit rlim;
   
   jmethodID utilMethod;
   jstring argString;
 
   /* process command line args */
   opterr = 0;
-  if(getopt(argc, argv, "d:") != 'd') {
-    usage();
+  workdir[0] = '\0';
+  gettimeofday(&starttime, NULL);
+  while ((opt = getopt(argc, argv, "d:s:z:t:f:c:r:k:p:S:gT:D:v")) != -1) {
+    switch (opt) {
+    case 'd':
+      if (strlen(optarg) > PATH_MAX - 63) { // don't want workdir path > PATH_MAX - 64
+	die("working directory path too long");
+      }
+      strncpy(workdir, optarg, PATH_MAX - 64);
+      break;
+    case 's':
+      if (strcmp(optarg, "h2") == 0) {
+	sink = SINK_H2;
+      } else if (strcmp(optarg, "sqlite") == 0) {
+	sink = SINK_SQLITE;
+      } else {
+	usage();
+      }
+      break;
+    case 'z':
+      if (strcmp(optarg, "none") == 0) {
+	backup = BACKUP_NONE;
+      } else if (strcmp(optarg, "zip") == 0) {
+	backup = BACKUP_ZIP;
+      } else if (strcmp(optarg, "tgz") == 0) {
+	backup = BACKUP_TGZ;
+      } else {
+	usage();
+      }
+      break;
+    case 't':
+      flowtimeout = atol(optarg);
+      if (flowtimeout < 0) {
+	usage();
+      }
+      break;
+    case 'f':
+      filter = optarg;
+      break;
+    case 'c':
+      if (parse_caprule(optarg) == -1) {
+	usage();
+      }
+      break;
+    case 'r':
+      samplerate = atol(optarg);
+      if (samplerate < 1) {
+	usage();
+      }
+      break;
+    case 'k':
+      checkpointinterval = atol(optarg);
+      if (checkpointinterval < 0) {
+	usage();
+      }
+      break;
+    case 'p':
+      partitioninterval = atol(optarg);
+      if (partitioninterval < 0) {
+	usage();
+      }
+      break;
+    case 'S':
+      statsfile = optarg;
+      break;
+    case 'g':
+      payloadindex = 1;
+      break;
+    case 'T':
+      if (tags_load(optarg) == -1) {
+	die("failed to load the tag patterns");
+      }
+      break;
+    case 'D':
+      dedupwindow = atol(optarg);
+      if (dedupwindow < 0) {
+	usage();
+      }
+      break;
+    case 'v':
+      verbose = 1;
+      break;
+    default:
+      usage();
+    }
   }
-  if (strlen(optarg) > PATH_MAX - 63) { // don't want workdir path > PATH_MAX - 64
-    die("working directory path too long");
+  if (workdir[0] == '\0') {
+    usage();
   }
 
   /* get working directory, chdir() to it and see if it's writeable */
@@ -900,7 +4502,7 @@ int main (int argc, char *argv[]) {
     logf("FATAL: getcwd() failed: %s)", strerror(errno));
     exit(EXIT_FAILURE);
   }
-  res = chdir(optarg); // see if dir exists and is searchable
+  res = chdir(workdir); // see if dir exists and is searchable
   if (res == -1) {
     logf("FATAL: cannot chdir() to supplied working directory: %s)", strerror(errno));
     exit(EXIT_FAILURE);
@@ -921,29 +4523,51 @@ int main (int argc, char *argv[]) {
     exit(EXIT_FAILURE);
   }
   free(pathbuf);
-  /* set workdir */
-  strncpy(workdir, optarg, PATH_MAX - 64);
 
-  /* get and set input file, error handling is done by libnids */
+  /* get and set input file */
   if((argc - optind) != 1) {
     usage();
   }
   strncpy(inputfile, argv[optind], PATH_MAX);
 
-  /* get and set the class path */
-  classpath = getenv("CLASSPATH");
-  if (classpath == NULL) {
-    die("CLASSPATH must be set");
+  /* get and set the class path, the JVM is only needed for H2 */
+  if (sink == SINK_H2) {
+    classpath = getenv("CLASSPATH");
+    if (classpath == NULL) {
+      die("CLASSPATH must be set");
+    }
   }
   
   /* all strings there to get started, summarize them  */
   logf("input file: %s", inputfile);
   logf("supplied working directory: %s", workdir);
-  logf("CLASSPATH: %s", classpath);
+  logf("sink: %s", sink == SINK_SQLITE ? "sqlite" : "h2");
+  logf("flow timeout: %ld s", flowtimeout);
+  if (filter != NULL) {
+    logf("BPF filter: %s", filter);
+  }
+  for (i = 0; i < n_caprules; i++) {
+    logf("payload cap: proto %d, port %d: %ld bytes", caprules[i].ip_p, caprules[i].port, caprules[i].bytes);
+  }
+  logf("sampling 1 out of %ld flows", samplerate);
+  logf("checkpoint every %ld packets", checkpointinterval);
+  logf("partition interval: %ld s", partitioninterval);
+  if (classpath != NULL) {
+    logf("CLASSPATH: %s", classpath);
+  }
   
+  /* open the pcap file ourselves, so that the offset of the packets processed is known for checkpoints */
+  pcap = pcap_open_offline(inputfile, pcaperrbuf);
+  if (pcap == NULL) {
+    logf("FATAL: pcap_open_offline() failed: %s", pcaperrbuf);
+    exit(EXIT_FAILURE);
+  }
+
   /* initialize libnids */
+  nids_params.pcap_desc = pcap; // takes precedence over filename
   nids_params.filename = inputfile; // file given on the command line
   nids_params.device = NULL; // no device, it's a file
+  nids_params.pcap_filter = filter; // applied by libnids before any processing
   /* disable multithreading as nids_last_pcap_header is shared beetwen threads, and so correct values are not guaranteed */
   nids_params.multiproc = 0;
 
@@ -952,52 +4576,99 @@ int main (int argc, char *argv[]) {
     logf("nids_init() failed: %s", nids_errbuf);
     exit(1);
   }
-  
-  /* start the JVM */
-  if (jvm_start(classpath) != JNI_OK) {
-    die("failed to start the jvm");
+
+  /* hold at most half of the file descriptors for stream files, the rest is left to the JVM and the databases */
+  if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur != RLIM_INFINITY) {
+    maxspoolfds = rlim.rlim_cur / 2;
+  } else {
+    maxspoolfds = 512;
   }
-  log("jvm started");
+  
+  if (sink == SINK_SQLITE) {
+    sql_open();
+  } else {
+    /* start the JVM */
+    if (jvm_start(classpath) != JNI_OK) {
+      die("failed to start the jvm");
+    }
+    log("jvm started");
 
-  init_jobjectholders();
+    init_jobjectholders();
   
-  /* create our pcap2sql.Util object */
-  utilMethod = (*jni)->GetMethodID(jni, Util.class, "<init>", "(Ljava/lang/String;)V");
-  e();
-  argString = (*jni)->NewStringUTF(jni, workdir); // method argument = workdir
-  e();
-  Util.object = (*jni)->NewObject(jni, Util.class, utilMethod, argString);
-  e();
+    /* create our pcap2sql.Util object */
+    utilMethod = (*jni)->GetMethodID(jni, Util.class, "<init>", "(Ljava/lang/String;Z)V");
+    e();
+    argString = (*jni)->NewStringUTF(jni, workdir); // method argument = workdir
+    e();
+    Util.object = (*jni)->NewObject(jni, Util.class, utilMethod, argString, (jboolean) (partitioninterval > 0));
+    e();
+  }
+
+  /* the only database, partitions are opened as the packets come */
+  if (partitioninterval == 0) {
+    use_partition(partition_open(0, NULL));
+  }
+
+  flows_init();
+
+  /* continue from a checkpoint left in the working directory */
+  offset = resume();
+  if (offset > 0 && fseek(pcap_file(pcap), offset, SEEK_SET) == -1) {
+    logf("FATAL: cannot seek to offset %ld of the pcap file: %s", offset, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
 
   /* register the callback functions */
   nids_register_ip(&ip4_callback);
   nids_register_tcp(&tcp4_callback);
   nids_register_udp(&udp4_callback);
 
-  /* the loop */
-  nids_run();
-
-  /* insert all non-TCP streams */
-  while ((Ip4Stream.object = Util_iterateAllNonTcp4Streams()) != NULL) {
-    Ip4Stream_setData(to_streamfile_path(Ip4Stream_getId()));
+  startpackets = packets;
+  startoffset = ftell(pcap_file(pcap));
 
-    /* delete local references explicitly */
-    (*jni)->DeleteLocalRef(jni, Ip4Stream.object);
+  /* the loop, interrupted for a checkpoint every checkpointinterval packets, otherwise for the statistics */
+  while ((res = dispatch(checkpointinterval > 0 ? checkpointinterval : STATS_PACKETS)) > 0) {
+    packets += res;
+    if (checkpointinterval > 0) {
+      write_checkpoint(ftell(pcap_file(pcap)));
+    }
+    stats_sample();
   }
+  if (res == -1) {
+    logf("dispatch() failed: %s", nids_errbuf);
+  }
+  /* a later run can add packets appended to the pcap file, the flows still active are continued then */
+  offset = ftell(pcap_file(pcap));
+  write_checkpoint(offset);
 
-  /* close the DB */
-  utilMethod = (*jni)->GetMethodID(jni, Util.class, "closeDb", "()V");
-  e();
-  (*jni)->CallVoidMethod(jni, Util.object, utilMethod);
-  e();
+  /* all packets are read, nids_run() returns right away after libnids has finished the open connections
+     (NIDS_EXITING) */
+  nids_run();
+
+  /* insert the non-TCP streams still active */
+  finish_all_flows();
+  close_all_partitions();
+  stats_sample();
 
-  /* shut down the JVM */
-  if(jvm_shutdown() == JNI_OK) {
-    log("jvm shut down");
+  if (sink == SINK_SQLITE) {
+    sql_close();
   } else {
-    log("failed to shut down the jvm");
+    /* close the DB */
+    utilMethod = (*jni)->GetMethodID(jni, Util.class, "closeDb", "(I)V");
+    e();
+    (*jni)->CallVoidMethod(jni, Util.object, utilMethod, (jint) backup);
+    e();
+
+    /* shut down the JVM */
+    if(jvm_shutdown() == JNI_OK) {
+      log("jvm shut down");
+    } else {
+      log("failed to shut down the jvm");
+    }
   }
 
+  write_stats(offset);
+
   log("exiting");
   exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,283 @@
+package pcap2sql;
+
+import java.io.File;
+import java.io.FileInputStream;
+import java.io.FileOutputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.io.OutputStream;
+import java.util.LinkedList;
+import java.util.List;
+import java.util.concurrent.Callable;
+import java.util.concurrent.ExecutionException;
+import java.util.concurrent.ExecutorService;
+import java.util.concurrent.Executors;
+import java.util.concurrent.Future;
+import java.util.zip.CRC32;
+import java.util.zip.Deflater;
+
+
+/**
+ * Writes the database files into a gzip compressed tar archive using all available processors
+ *
+ * The tar stream is cut into blocks that are compressed in parallel, each into a gzip member of its own (like pigz
+ * does). The members are written in order, so the result is a standard .tar.gz file.
+ *
+ * @author Gyoergy Kohut <gyoergy.kohut@cs.uni-dortmund.de>
+*/
+public class ParallelBackup {
+	private static final int BLOCK_SIZE = 1 << 20;
+	private static final int TAR_BLOCK_SIZE = 512;
+
+	private final OutputStream out;
+	private final ExecutorService executor;
+	private final int maxPending;
+	private final LinkedList<Future<byte[]>> pending = new LinkedList<Future<byte[]>>();
+
+	private byte[] block = new byte[BLOCK_SIZE];
+	private int blockLength = 0;
+
+
+	private ParallelBackup(OutputStream out) {
+		int threads = Runtime.getRuntime().availableProcessors();
+
+		this.out = out;
+		this.executor = Executors.newFixedThreadPool(threads);
+		this.maxPending = 2 * threads;
+	}
+
+
+	/**
+	 * Archives all files in directory belonging to the database db into archiveFileName, all databases if db is null
+	 */
+	public static void execute(String archiveFileName, String directory, String db) throws IOException {
+		File archiveFile = new File(archiveFileName);
+		List<File> files = new LinkedList<File>();
+		File[] entries = new File(directory).listFiles();
+
+		if (entries == null) {
+			throw new IOException("cannot list " + directory);
+		}
+		for (File entry : entries) {
+			String name = entry.getName();
+			boolean member = db != null ? name.startsWith(db + ".") : name.endsWith(".db");
+			if (member && !name.endsWith(".lock.db") && !entry.equals(archiveFile)) {
+				listFiles(entry, files);
+			}
+		}
+
+		FileOutputStream fileOutputStream = new FileOutputStream(archiveFile);
+		ParallelBackup backup = new ParallelBackup(fileOutputStream);
+		try {
+			String prefix = new File(directory).getPath() + File.separator;
+			for (File file : files) {
+				backup.addFile(file.getPath().substring(prefix.length()), file);
+			}
+			backup.finish();
+		}
+		finally {
+			backup.executor.shutdownNow();
+			fileOutputStream.close();
+		}
+	}
+
+
+	private static void listFiles(File file, List<File> files) {
+		if (file.isDirectory()) {
+			File[] entries = file.listFiles();
+			if (entries != null) {
+				for (File entry : entries) {
+					listFiles(entry, files);
+				}
+			}
+		}
+		else {
+			files.add(file);
+		}
+	}
+
+
+	private void addFile(String name, File file) throws IOException {
+		long length = file.length();
+		byte[] buf = new byte[65536];
+		int n;
+
+		write(tarHeader(name.replace(File.separatorChar, '/'), length, file.lastModified() / 1000));
+
+		InputStream in = new FileInputStream(file);
+		try {
+			long remaining = length;
+			// the size in the header is authoritative, don't write more even if the file has grown
+			while (remaining > 0 && (n = in.read(buf, 0, (int) Math.min(buf.length, remaining))) != -1) {
+				write(buf, 0, n);
+				remaining -= n;
+			}
+			if (remaining > 0) {
+				throw new IOException(file.getPath() + " shrank while archiving it");
+			}
+		}
+		finally {
+			in.close();
+		}
+
+		int padding = (int) ((TAR_BLOCK_SIZE - length % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE);
+		write(new byte[padding]);
+	}
+
+
+	private void finish() throws IOException {
+		// end of archive: two empty tar blocks
+		write(new byte[2 * TAR_BLOCK_SIZE]);
+		submitBlock();
+		while (!pending.isEmpty()) {
+			writeCompressedBlock();
+		}
+		out.flush();
+	}
+
+
+	private void write(byte[] buf) throws IOException {
+		write(buf, 0, buf.length);
+	}
+
+
+	private void write(byte[] buf, int offset, int length) throws IOException {
+		while (length > 0) {
+			int n = Math.min(length, BLOCK_SIZE - blockLength);
+			System.arraycopy(buf, offset, block, blockLength, n);
+			blockLength += n;
+			offset += n;
+			length -= n;
+
+			if (blockLength == BLOCK_SIZE) {
+				submitBlock();
+			}
+		}
+	}
+
+
+	private void submitBlock() throws IOException {
+		if (blockLength == 0) {
+			return;
+		}
+
+		final byte[] data = block;
+		final int dataLength = blockLength;
+		pending.add(executor.submit(new Callable<byte[]>() {
+			public byte[] call() {
+				return gzip(data, dataLength);
+			}
+		}));
+		block = new byte[BLOCK_SIZE];
+		blockLength = 0;
+
+		// don't let the compressed blocks pile up in memory
+		while (pending.size() > maxPending) {
+			writeCompressedBlock();
+		}
+	}
+
+
+	private void writeCompressedBlock() throws IOException {
+		try {
+			out.write(pending.removeFirst().get());
+		}
+		catch (InterruptedException e) {
+			throw new IOException("interrupted while compressing");
+		}
+		catch (ExecutionException e) {
+			throw new IOException("compressing failed: " + e.getCause());
+		}
+	}
+
+
+	/**
+	 * Compresses data into a complete gzip member
+	 */
+	private static byte[] gzip(byte[] data, int length) {
+		Deflater deflater = new Deflater(Deflater.DEFAULT_COMPRESSION, true);
+		CRC32 crc = new CRC32();
+		byte[] buf = new byte[length + length / 1000 + 1024];
+		int n;
+
+		crc.update(data, 0, length);
+		deflater.setInput(data, 0, length);
+		deflater.finish();
+
+		// 10 bytes header: magic, deflate, no flags, no mtime, no extra flags, unknown OS
+		byte[] header = {(byte) 0x1f, (byte) 0x8b, 8, 0, 0, 0, 0, 0, 0, (byte) 0xff};
+		System.arraycopy(header, 0, buf, 0, header.length);
+		n = header.length;
+		while (!deflater.finished()) {
+			if (n == buf.length) {
+				byte[] larger = new byte[2 * buf.length];
+				System.arraycopy(buf, 0, larger, 0, n);
+				buf = larger;
+			}
+			n += deflater.deflate(buf, n, buf.length - n);
+		}
+		deflater.end();
+
+		// 8 bytes trailer: CRC32 and input size, little endian
+		byte[] member = new byte[n + 8];
+		System.arraycopy(buf, 0, member, 0, n);
+		putIntLE(member, n, (int) crc.getValue());
+		putIntLE(member, n + 4, length);
+		return member;
+	}
+
+
+	private static void putIntLE(byte[] buf, int offset, int value) {
+		buf[offset] = (byte) value;
+		buf[offset + 1] = (byte) (value >>> 8);
+		buf[offset + 2] = (byte) (value >>> 16);
+		buf[offset + 3] = (byte) (value >>> 24);
+	}
+
+
+	/**
+	 * Creates a POSIX ustar header for a regular file
+	 */
+	private static byte[] tarHeader(String name, long size, long mtime) throws IOException {
+		byte[] header = new byte[TAR_BLOCK_SIZE];
+		byte[] nameBytes = name.getBytes("UTF-8");
+
+		if (nameBytes.length > 100) {
+			throw new IOException("file name too long for the archive: " + name);
+		}
+		System.arraycopy(nameBytes, 0, header, 0, nameBytes.length);
+		putOctal(header, 100, 8, 0644);
+		putOctal(header, 108, 8, 0);
+		putOctal(header, 116, 8, 0);
+		putOctal(header, 124, 12, size);
+		putOctal(header, 136, 12, mtime);
+		header[156] = '0';
+		System.arraycopy("ustar\u000000".getBytes("US-ASCII"), 0, header, 257, 8);
+
+		// the checksum is calculated with the checksum field set to spaces
+		for (int i = 148; i < 156; i++) {
+			header[i] = ' ';
+		}
+		long checksum = 0;
+		for (byte b : header) {
+			checksum += b & 0xff;
+		}
+		putOctal(header, 148, 7, checksum);
+
+		return header;
+	}
+
+
+	private static void putOctal(byte[] header, int offset, int length, long value) throws IOException {
+		String s = Long.toOctalString(value);
+
+		if (s.length() > length - 1) {
+			throw new IOException("value too large for the archive header: " + value);
+		}
+		while (s.length() < length - 1) {
+			s = "0" + s;
+		}
+		System.arraycopy(s.getBytes("US-ASCII"), 0, header, offset, length - 1);
+		header[offset + length - 1] = 0;
+	}
+}
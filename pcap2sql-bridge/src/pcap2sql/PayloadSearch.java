@@ -0,0 +1,167 @@
+package pcap2sql;
+
+import java.io.BufferedInputStream;
+import java.io.IOException;
+import java.io.InputStream;
+import java.sql.Connection;
+import java.sql.PreparedStatement;
+import java.sql.ResultSet;
+import java.sql.SQLException;
+import java.sql.Types;
+import java.util.LinkedHashSet;
+import java.util.LinkedList;
+import java.util.List;
+import java.util.Set;
+
+import org.h2.tools.SimpleResultSet;
+
+
+/**
+ * The table function PAYLOAD_SEARCH(pattern) of the H2 databases, returning the id of each stream whose data contains
+ * the byte pattern and the offset of each occurrence in it e.g.
+ *
+ * SELECT * FROM PAYLOAD_SEARCH(STRINGTOUTF8('evil.example'))
+ *
+ * For patterns of 3 or more bytes, only the data of the streams listed in the payload index (the table PayloadGram,
+ * built with -g) for all trigrams of the pattern is read. Shorter patterns need to read the data of all streams.
+ *
+ * @author Gyoergy Kohut <gyoergy.kohut@cs.uni-dortmund.de>
+*/
+public class PayloadSearch {
+	public static ResultSet search(Connection connection, byte[] pattern) throws SQLException {
+		SimpleResultSet result = new SimpleResultSet();
+		result.addColumn("STREAMID", Types.INTEGER, 10, 0);
+		result.addColumn("OFFSET", Types.BIGINT, 19, 0);
+		
+		// H2 calls the function once to get the columns only
+		if (connection.getMetaData().getURL().equals("jdbc:columnlist:connection") || pattern == null ||
+				pattern.length == 0) {
+			return result;
+		}
+		
+		PreparedStatement s = connection.prepareStatement("SELECT data FROM Ip4Stream WHERE id = ?");
+		for (Integer id : candidates(connection, pattern)) {
+			s.setInt(1, id);
+			ResultSet r = s.executeQuery();
+			if (r.next()) {
+				InputStream in = r.getBinaryStream(1);
+				if (in != null) {
+					try {
+						for (Long offset : find(in, pattern)) {
+							result.addRow(new Object[] {id, offset});
+						}
+					}
+					catch (IOException e) {
+						throw new SQLException("reading the data of stream " + id + " failed: " + e);
+					}
+				}
+			}
+			r.close();
+		}
+		s.close();
+		
+		return result;
+	}
+	
+	
+	/**
+	 * Returns the ids of the streams that may contain pattern
+	 */
+	private static List<Integer> candidates(Connection connection, byte[] pattern) throws SQLException {
+		List<Integer> ids = new LinkedList<Integer>();
+		Set<Integer> grams = new LinkedHashSet<Integer>();
+		PreparedStatement s;
+		
+		for (int i = 0; i + 3 <= pattern.length; i++) {
+			grams.add(gram(pattern, i));
+		}
+		
+		if (grams.isEmpty()) {
+			s = connection.prepareStatement("SELECT id FROM Ip4Stream WHERE data IS NOT NULL ORDER BY id");
+		}
+		else {
+			StringBuilder sql = new StringBuilder("SELECT streamId FROM PayloadGram WHERE gram IN (");
+			for (int i = 0; i < grams.size(); i++) {
+				sql.append(i == 0 ? "?" : ", ?");
+			}
+			sql.append(") GROUP BY streamId HAVING COUNT(*) = ? ORDER BY streamId");
+			s = connection.prepareStatement(sql.toString());
+			int n = 1;
+			for (Integer gram : grams) {
+				s.setBytes(n++, gram(gram));
+			}
+			s.setInt(n, grams.size());
+		}
+		
+		ResultSet r = s.executeQuery();
+		while (r.next()) {
+			ids.add(r.getInt(1));
+		}
+		r.close();
+		s.close();
+		
+		return ids;
+	}
+	
+	
+	/**
+	 * Returns the offsets of all occurrences of pattern in the stream (Knuth-Morris-Pratt, reading it once)
+	 */
+	private static List<Long> find(InputStream in, byte[] pattern) throws IOException {
+		List<Long> offsets = new LinkedList<Long>();
+		int[] next = new int[pattern.length];
+		int k = 0;
+		long position = 0;
+		int b;
+		
+		// next[i]: length of the longest proper prefix of pattern[0..i] that is also a suffix of it
+		for (int i = 1; i < pattern.length; i++) {
+			while (k > 0 && pattern[i] != pattern[k]) {
+				k = next[k - 1];
+			}
+			if (pattern[i] == pattern[k]) {
+				k++;
+			}
+			next[i] = k;
+		}
+		
+		in = new BufferedInputStream(in, 65536);
+		k = 0;
+		try {
+			while ((b = in.read()) != -1) {
+				while (k > 0 && (byte) b != pattern[k]) {
+					k = next[k - 1];
+				}
+				if ((byte) b == pattern[k]) {
+					k++;
+				}
+				position++;
+				if (k == pattern.length) {
+					offsets.add(position - pattern.length);
+					k = next[k - 1];
+				}
+			}
+		}
+		finally {
+			in.close();
+		}
+		
+		return offsets;
+	}
+	
+	
+	/**
+	 * The trigram at offset i of data as an int, like the native code builds the index
+	 */
+	static int gram(byte[] data, int i) {
+		return ((data[i] & 0xff) << 16) | ((data[i + 1] & 0xff) << 8) | (data[i + 2] & 0xff);
+	}
+	
+	
+	/**
+	 * The trigram as stored in PayloadGram
+	 */
+	static byte[] gram(int gram) {
+		return new byte[] {(byte) (gram >>> 16), (byte) (gram >>> 8), (byte) gram};
+	}
+}
@@ -1,9 +1,19 @@
 package pcap2sql;
 
+import java.io.File;
+import java.io.IOException;
+import java.sql.Connection;
+import java.sql.DriverManager;
+import java.sql.PreparedStatement;
+import java.sql.ResultSet;
 import java.sql.SQLException;
+import java.sql.Statement;
 import java.sql.Timestamp;
+import java.util.HashMap;
 import java.util.Iterator;
+import java.util.LinkedList;
 import java.util.List;
+import java.util.Map;
 import java.util.NoSuchElementException;
 import java.util.Properties;
 
@@ -27,32 +37,185 @@ import pcap2sql.orm.*;
 public class Util {
 	private final static String DBNAME = "db";
 	
+	/* backup modes for closeDb() */
+	public final static int BACKUP_NONE = 0;
+	public final static int BACKUP_ZIP = 1;
+	public final static int BACKUP_TGZ = 2;
+	
+	/* tables of the records extracted from the payload, all having the columns streamId and segment */
+	private final static String[] RECORD_TABLES = {"HttpRequest", "TlsClientHello", "DnsRecord", "PayloadTag"};
+	
 	private final String jdbcUrl;
 	private final String dbDirPath;
 	
-	private final EntityManagerFactory entityManagerFactory;
-    private final EntityManager entityManager;
+	/* open partitions by index, without partitioning there is just DBNAME with index 0 */
+	private final Map<Integer, EntityManagerFactory> entityManagerFactories = new HashMap<Integer, EntityManagerFactory>();
+	private final Map<Integer, EntityManager> entityManagers = new HashMap<Integer, EntityManager>();
+	private final Map<Integer, String> partitionNames = new HashMap<Integer, String>();
+	/* the partition currently worked on */
+	private EntityManager entityManager = null;
+	/* the catalog of the partitions, null without partitioning */
+	private Connection catalog = null;
+	/* connections inserting the payload index and tags of the partitions in bulk, opened on first use */
+	private final Map<Integer, Connection> bulkConnections = new HashMap<Integer, Connection>();
+	private int partition = 0;
     
     private Iterator<Ip4Stream> allNonTcp4StreamsIterator = null;
     
     
-    public Util(String workdir) {
+    public Util(String workdir) throws SQLException {
+    	this(workdir, false);
+    }
+    
+    
+    /**
+     * With partitioned set, DBNAME only holds the catalog of the partitions, the table TimePartition
+     */
+    public Util(String workdir, boolean partitioned) throws SQLException {
     	jdbcUrl = "jdbc:h2:" + workdir + "/" + DBNAME;
     	dbDirPath = workdir;
     	
+    	if (partitioned) {
+    		try {
+    			Class.forName("org.h2.Driver");
+    		}
+    		catch (ClassNotFoundException e) {
+    			throw new SQLException("H2 driver not found");
+    		}
+    		catalog = DriverManager.getConnection(jdbcUrl, "sa", "sa");
+    		catalog.createStatement().execute("CREATE TABLE IF NOT EXISTS TimePartition " +
+    				"(name VARCHAR(32) PRIMARY KEY, startTime TIMESTAMP, endTime TIMESTAMP)");
+    		catalog.createStatement().execute("CREATE ALIAS IF NOT EXISTS PAYLOAD_SEARCH FOR " +
+    				"\"pcap2sql.PayloadSearch.search\"");
+    	}
+    }
+    
+    
+    /**
+     * Opens (or creates) the database of a partition and registers it in the catalog. The sequences of the entity ids
+     * are moved past the ids handed out in other partitions, so that the ids are unique over all partitions.
+     */
+    public void openPartition(int index, String name, Timestamp startTime, Timestamp endTime, int nextIp4StreamId,
+    		int nextTcp4ConnectionId, int nextUdp4StreamId) throws SQLException {
     	Properties properties = new Properties();
     	properties.put(PersistenceUnitProperties.JDBC_DRIVER, "org.h2.Driver");
     	properties.put(PersistenceUnitProperties.TARGET_DATABASE, TargetDatabase.Auto);
-    	properties.put(PersistenceUnitProperties.JDBC_URL, jdbcUrl);
+    	properties.put(PersistenceUnitProperties.JDBC_URL, "jdbc:h2:" + dbDirPath + "/" + name);
     	properties.put(PersistenceUnitProperties.JDBC_USER, "sa");
     	properties.put(PersistenceUnitProperties.JDBC_PASSWORD, "sa");
+    	// EclipseLink would share one session between all factories of the persistence unit otherwise
+    	properties.put(PersistenceUnitProperties.SESSION_NAME, name);
     	
     	// drop tables and create schema
     	//properties.put(PersistenceUnitProperties.DDL_GENERATION, PersistenceUnitProperties.DROP_AND_CREATE);
 
-    	entityManagerFactory = Persistence.createEntityManagerFactory("Default", properties);
-    	entityManager = entityManagerFactory.createEntityManager();
-     }
+    	EntityManagerFactory factory = Persistence.createEntityManagerFactory("Default", properties);
+    	EntityManager manager = factory.createEntityManager();
+    	entityManagerFactories.put(index, factory);
+    	entityManagers.put(index, manager);
+    	partitionNames.put(index, name);
+    	
+    	manager.getTransaction().begin();
+    	restartSequence(manager, "Ip4StreamSequence", nextIp4StreamId);
+    	restartSequence(manager, "Tcp4ConnectionSequence", nextTcp4ConnectionId);
+    	restartSequence(manager, "Udp4StreamSequence", nextUdp4StreamId);
+    	manager.createNativeQuery("CREATE INDEX IF NOT EXISTS FlowSummary_flow ON FlowSummary (proto, flowId)").executeUpdate();
+    	manager.createNativeQuery("CREATE INDEX IF NOT EXISTS FlowSummary_firstTime ON FlowSummary (firstTime)").executeUpdate();
+    	manager.createNativeQuery("CREATE INDEX IF NOT EXISTS HttpRequest_host ON HttpRequest (host)").executeUpdate();
+    	manager.createNativeQuery("CREATE INDEX IF NOT EXISTS TlsClientHello_serverName ON TlsClientHello (serverName)").executeUpdate();
+    	manager.createNativeQuery("CREATE INDEX IF NOT EXISTS DnsRecord_name ON DnsRecord (name)").executeUpdate();
+    	manager.createNativeQuery("CREATE TABLE IF NOT EXISTS PayloadGram (gram BINARY(3), streamId INT, " +
+    			"PRIMARY KEY (gram, streamId))").executeUpdate();
+    	manager.createNativeQuery("CREATE ALIAS IF NOT EXISTS PAYLOAD_SEARCH FOR " +
+    			"\"pcap2sql.PayloadSearch.search\"").executeUpdate();
+    	manager.createNativeQuery("CREATE TABLE IF NOT EXISTS PayloadTag (streamId INT, segment BIGINT, pattern INT, " +
+    			"offset BIGINT)").executeUpdate();
+    	manager.createNativeQuery("CREATE INDEX IF NOT EXISTS PayloadTag_pattern ON PayloadTag (pattern)").executeUpdate();
+    	manager.createNativeQuery("CREATE INDEX IF NOT EXISTS PayloadTag_streamId ON PayloadTag (streamId, segment)").executeUpdate();
+    	manager.getTransaction().commit();
+    	
+    	if (catalog != null) {
+    		PreparedStatement s = catalog.prepareStatement("MERGE INTO TimePartition KEY (name) VALUES (?, ?, ?)");
+    		s.setString(1, name);
+    		s.setTimestamp(2, startTime);
+    		s.setTimestamp(3, endTime);
+    		s.executeUpdate();
+    		s.close();
+    	}
+    }
+    
+    
+    /**
+     * Lets the sequence hand out next as its next value, unless it is already further
+     */
+    private void restartSequence(EntityManager manager, String sequence, int next) {
+    	Number current = (Number) manager.createNativeQuery(
+    			"SELECT CURRENT_VALUE FROM INFORMATION_SCHEMA.SEQUENCES WHERE SEQUENCE_NAME = ?1")
+    			.setParameter(1, sequence.toUpperCase()).getSingleResult();
+    	if (current.longValue() < next - 1) {
+    		manager.createNativeQuery("ALTER SEQUENCE " + sequence + " RESTART WITH " + next).executeUpdate();
+    	}
+    }
+    
+    
+    /**
+     * Selects the partition the following calls work on
+     */
+    public void usePartition(int index) {
+    	entityManager = entityManagers.get(index);
+    	partition = index;
+    }
+    
+    
+    /**
+     * Stores all changes of a partition and closes it, startTime is recorded in the catalog unless it is null
+     */
+    public void closePartition(int index, Timestamp startTime) throws SQLException {
+    	EntityManager manager = entityManagers.remove(index);
+    	String name = partitionNames.remove(index);
+    	Connection bulkConnection = bulkConnections.remove(index);
+    	
+    	if (bulkConnection != null) {
+    		bulkConnection.close();
+    	}
+    	
+    	manager.getTransaction().begin();
+    	manager.flush();
+    	manager.getTransaction().commit();
+    	manager.close();
+    	entityManagerFactories.remove(index).close();
+    	if (manager == entityManager) {
+    		entityManager = null;
+    	}
+    	
+    	if (catalog != null && startTime != null) {
+    		PreparedStatement s = catalog.prepareStatement("UPDATE TimePartition SET startTime = ? WHERE name = ?");
+    		s.setTimestamp(1, startTime);
+    		s.setString(2, name);
+    		s.executeUpdate();
+    		s.close();
+    	}
+    }
+    
+    
+    /**
+     * Deletes the partitions created after a checkpoint, whose names sort after name. They must not be open.
+     */
+    public void dropPartitionsAfter(String name) throws SQLException {
+    	PreparedStatement s = catalog.prepareStatement("SELECT name FROM TimePartition WHERE name > ?");
+    	s.setString(1, name);
+    	ResultSet r = s.executeQuery();
+    	while (r.next()) {
+    		org.h2.tools.DeleteDbFiles.execute(dbDirPath, r.getString(1), true);
+    	}
+    	r.close();
+    	s.close();
+    	
+    	s = catalog.prepareStatement("DELETE FROM TimePartition WHERE name > ?");
+    	s.setString(1, name);
+    	s.executeUpdate();
+    	s.close();
+    }
     
     
     public Ip4Stream newIp4Stream(String destIp, String sourceIp, int proto, Timestamp firstTime) {
@@ -108,6 +271,14 @@ public class Util {
 		return entityManager.find(Tcp4Connection.class, id);
 	}
 	
+	public Ip4Stream findIp4Stream(int id) {
+		return entityManager.find(Ip4Stream.class, id);
+	}
+	
+	public Udp4Stream findUdp4Stream(int id) {
+		return entityManager.find(Udp4Stream.class, id);
+	}
+	
 	
 	public Udp4Stream findUdp4Stream(String destIp, String sourceIp, int destPort, int sourcePort) {
 		Query q = entityManager.createNamedQuery("tuple4find_Udp4Stream");
@@ -155,21 +326,272 @@ public class Util {
 	}
 
 	
-    public void closeDb() throws SQLException {
-        // persist any changes
-        entityManager.getTransaction().begin();
-        entityManager.flush();
-        entityManager.getTransaction().commit();
+	/**
+	 * Stores the counters of a finished flow, inStreamId 0, meanInterArrival < 0 and finalStatus -1 stand for none
+	 */
+	public void newFlowSummary(int streamId, int proto, int flowId, int inStreamId, Timestamp firstTime,
+			Timestamp lastTime, double duration, long outPackets, long outBytes, long inPackets, long inBytes,
+			double meanInterArrival, int finalStatus) {
+		FlowSummary flowSummary = new FlowSummary(streamId, proto, flowId, inStreamId != 0 ? inStreamId : null,
+				firstTime, lastTime, duration, outPackets, outBytes, inPackets, inBytes,
+				meanInterArrival >= 0 ? meanInterArrival : null, finalStatus != -1 ? finalStatus : null);
+		
+		entityManager.getTransaction().begin();
+		entityManager.persist(flowSummary);
+		entityManager.getTransaction().commit();
+		entityManager.detach(flowSummary);
+	}
+	
+	
+	/**
+	 * Stores a record extracted from the payload of a stream and detaches it right away, as nothing refers to it later
+	 */
+	private void persistRecord(Object record) {
+		entityManager.getTransaction().begin();
+		entityManager.persist(record);
+		entityManager.getTransaction().commit();
+		entityManager.detach(record);
+	}
+	
+	
+	public void newHttpRequest(int streamId, long segment, int number, Timestamp time, String method, String uri,
+			String version, String host, String userAgent) {
+		persistRecord(new HttpRequest(streamId, segment, number, time, method, uri, version, host, userAgent));
+	}
+	
+	
+	public void newTlsClientHello(int streamId, long segment, int number, Timestamp time, int version,
+			String serverName) {
+		persistRecord(new TlsClientHello(streamId, segment, number, time, version, serverName));
+	}
+	
+	
+	public void newDnsRecord(int streamId, long segment, int number, Timestamp time, int transactionId,
+			boolean response, int rcode, int section, String name, int type, String data) {
+		persistRecord(new DnsRecord(streamId, segment, number, time, transactionId, response, rcode, section, name,
+				type, data));
+	}
+	
+	
+	/**
+	 * Adds a finished stream to the payload index, grams are the distinct trigrams of its data
+	 */
+	public void addPayloadGrams(int streamId, int[] grams) throws SQLException {
+		Connection connection = bulkConnection();
+		PreparedStatement s = connection.prepareStatement("MERGE INTO PayloadGram KEY (gram, streamId) VALUES (?, ?)");
+		for (int gram : grams) {
+			s.setBytes(1, PayloadSearch.gram(gram));
+			s.setInt(2, streamId);
+			s.addBatch();
+		}
+		s.executeBatch();
+		s.close();
+		connection.commit();
+	}
+	
+	
+	/**
+	 * Stores the matches of the tag patterns found in a segment of a stream, offsets are those of their first bytes
+	 */
+	public void addPayloadTags(int streamId, long segment, int[] patterns, long[] offsets) throws SQLException {
+		Connection connection = bulkConnection();
+		PreparedStatement s = connection.prepareStatement("INSERT INTO PayloadTag VALUES (?, ?, ?, ?)");
+		
+		for (int i = 0; i < patterns.length; i++) {
+			s.setInt(1, streamId);
+			s.setLong(2, segment);
+			s.setInt(3, patterns[i]);
+			s.setLong(4, offsets[i]);
+			s.addBatch();
+		}
+		s.executeBatch();
+		s.close();
+		connection.commit();
+	}
+	
+	
+	/**
+	 * Returns the connection for bulk inserts into the current partition
+	 */
+	private Connection bulkConnection() throws SQLException {
+		Connection connection = bulkConnections.get(partition);
+		
+		if (connection == null) {
+			connection = DriverManager.getConnection("jdbc:h2:" + dbDirPath + "/" + partitionNames.get(partition),
+					"sa", "sa");
+			connection.setAutoCommit(false);
+			bulkConnections.put(partition, connection);
+		}
+		return connection;
+	}
+	
+	
+	/**
+	 * Stores any changes of entity and detaches it from the persistence context, so that it can be garbage collected
+	 * once the native code deletes its reference
+	 */
+	public void evict(Object entity) {
+		entityManager.getTransaction().begin();
+		entityManager.getTransaction().commit();
+		entityManager.detach(entity);
+	}
+
+	
+	/**
+	 * Stores all changes, the database then matches the checkpoint written by the native code
+	 */
+	public void checkpoint() {
+		for (EntityManager manager : entityManagers.values()) {
+			manager.getTransaction().begin();
+			manager.getTransaction().commit();
+		}
+	}
+	
+	
+	/**
+	 * Removes all records created after a checkpoint, given the highest ids at the checkpoint. Must be called before
+	 * any entity is loaded, applies to all open partitions.
+	 */
+	public void rollback(int maxIp4StreamId, int maxTcp4ConnectionId, int maxUdp4StreamId) {
+		for (EntityManager manager : entityManagers.values()) {
+			manager.getTransaction().begin();
+			manager.createNativeQuery("DELETE FROM Tcp4Connection WHERE id > ?1")
+				.setParameter(1, maxTcp4ConnectionId).executeUpdate();
+			manager.createNativeQuery("DELETE FROM Udp4Stream WHERE id > ?1")
+				.setParameter(1, maxUdp4StreamId).executeUpdate();
+			manager.createNativeQuery("DELETE FROM StreamSegment WHERE streamId > ?1")
+				.setParameter(1, maxIp4StreamId).executeUpdate();
+			manager.createNativeQuery("DELETE FROM FlowSummary WHERE streamId > ?1")
+				.setParameter(1, maxIp4StreamId).executeUpdate();
+			for (String table : RECORD_TABLES) {
+				manager.createNativeQuery("DELETE FROM " + table + " WHERE streamId > ?1")
+					.setParameter(1, maxIp4StreamId).executeUpdate();
+			}
+			manager.createNativeQuery("DELETE FROM PayloadGram WHERE streamId > ?1")
+				.setParameter(1, maxIp4StreamId).executeUpdate();
+			manager.createNativeQuery("DELETE FROM Ip4Stream WHERE id > ?1")
+				.setParameter(1, maxIp4StreamId).executeUpdate();
+			manager.getTransaction().commit();
+		}
+	}
+	
+	
+	/**
+	 * Rolls a stream still open at a checkpoint back to its state at the checkpoint
+	 */
+	public void rollbackIp4Stream(int id, long segments, Timestamp lastTime) {
+		entityManager.getTransaction().begin();
+		entityManager.createNativeQuery("DELETE FROM StreamSegment WHERE streamId = ?1 AND number > ?2")
+			.setParameter(1, id).setParameter(2, segments).executeUpdate();
+		entityManager.createNativeQuery("DELETE FROM FlowSummary WHERE streamId = ?1")
+			.setParameter(1, id).executeUpdate();
+		for (String table : RECORD_TABLES) {
+			entityManager.createNativeQuery("DELETE FROM " + table + " WHERE streamId = ?1 AND segment > ?2")
+				.setParameter(1, id).setParameter(2, segments).executeUpdate();
+		}
+		entityManager.createNativeQuery("DELETE FROM PayloadGram WHERE streamId = ?1")
+			.setParameter(1, id).executeUpdate();
+		entityManager.createNativeQuery("UPDATE Ip4Stream SET data = NULL, lastTime = ?2 WHERE id = ?1")
+			.setParameter(1, id).setParameter(2, lastTime).executeUpdate();
+		entityManager.getTransaction().commit();
+	}
+	
+	
+	/**
+	 * Rolls a connection still open at a checkpoint back to its state at the checkpoint
+	 */
+	public void rollbackTcp4Connection(int id, Timestamp lastTime) {
+		entityManager.getTransaction().begin();
+		entityManager.createNativeQuery("UPDATE Tcp4Connection SET finalStatus = 0, lastTime = ?2 WHERE id = ?1")
+			.setParameter(1, id).setParameter(2, lastTime).executeUpdate();
+		entityManager.getTransaction().commit();
+	}
+	
+	
+    public void closeDb() throws SQLException, IOException {
+    	closeDb(BACKUP_ZIP);
+    }
+    
+    
+    public void closeDb(int backup) throws SQLException, IOException {
+        // persist any changes and shut down JPA on the partitions still open
+        for (Integer index : new LinkedList<Integer>(entityManagers.keySet())) {
+        	closePartition(index, null);
+        }
         
-        // shut down JPA
-        entityManager.close();
-        entityManagerFactory.close();
+        if (catalog != null) {
+        	updateCatalogViews();
+        	catalog.close();
+        }
         
         // SQL dump
         //org.h2.tools.Script.execute(jdbcUrl, "sa", "", dbDirPath + "/" + DBNAME + ".sql");
         
-        // backup the DB to a zip file
-        org.h2.tools.Backup.execute(dbDirPath + "/" + DBNAME + ".zip", dbDirPath, DBNAME, false);
+        // with partitions, the backup holds all databases in the working directory
+        String db = catalog != null ? null : DBNAME;
+        switch (backup) {
+        case BACKUP_ZIP:
+        	// backup the DB to a zip file
+        	org.h2.tools.Backup.execute(dbDirPath + "/" + DBNAME + ".zip", dbDirPath, db, false);
+        	break;
+        case BACKUP_TGZ:
+        	// backup the DB to a tar.gz file compressed on all processors
+        	ParallelBackup.execute(dbDirPath + "/" + DBNAME + ".tar.gz", dbDirPath, db);
+        	break;
+        default:
+        	// the database files are usable as they are
+        	break;
+        }
+    }
+    
+    
+    /**
+     * Links the tables of all partitions into the catalog and creates views named like the tables that union them, so
+     * that the whole capture can still be queried at once. Queries limited in time can use TimePartition to open only
+     * the partitions they need instead.
+     */
+    private void updateCatalogViews() throws SQLException {
+    	String[] tables = {"Ip4Stream", "Tcp4Connection", "Udp4Stream", "StreamSegment", "FlowSummary", "HttpRequest",
+    			"TlsClientHello", "DnsRecord", "PayloadGram", "PayloadTag"};
+    	List<String> names = new LinkedList<String>();
+    	List<String> links = new LinkedList<String>();
+    	Statement s = catalog.createStatement();
+    	String path = new File(dbDirPath).getAbsolutePath();
+    	ResultSet r;
+    	
+    	for (String table : tables) {
+    		s.execute("DROP VIEW IF EXISTS " + table);
+    	}
+    	r = s.executeQuery("SELECT TABLE_NAME FROM INFORMATION_SCHEMA.TABLES WHERE TABLE_TYPE = 'TABLE LINK'");
+    	while (r.next()) {
+    		links.add(r.getString(1));
+    	}
+    	r.close();
+    	for (String link : links) {
+    		s.execute("DROP TABLE " + link);
+    	}
+    	
+    	r = s.executeQuery("SELECT name FROM TimePartition ORDER BY name");
+    	while (r.next()) {
+    		names.add(r.getString(1));
+    	}
+    	r.close();
+    	if (names.isEmpty()) {
+    		s.close();
+    		return;
+    	}
+    	
+    	for (String table : tables) {
+    		StringBuilder view = new StringBuilder();
+    		for (String name : names) {
+    			s.execute("CREATE LINKED TABLE " + name + "_" + table + "('org.h2.Driver', 'jdbc:h2:" + path + "/" + name +
+    					"', 'sa', 'sa', '" + table.toUpperCase() + "')");
+    			view.append(view.length() == 0 ? "CREATE VIEW " + table + " AS " : " UNION ALL ");
+    			view.append("SELECT * FROM " + name + "_" + table);
+    		}
+    		s.execute(view.toString());
+    	}
+    	s.close();
     }
   
 }
@@ -0,0 +1,98 @@
+package pcap2sql.orm;
+
+import java.io.Serializable;
+import java.sql.Timestamp;
+import javax.persistence.*;
+
+/**
+ * Entity class for mapping to the table DnsRecord
+ *
+ * One record per question and per answer of a DNS message carried in a UDP stream.
+ *
+ * @author Gyoergy Kohut <gyoergy.kohut@cs.uni-dortmund.de>
+ */
+@Entity
+@IdClass(SegmentRecordId.class)
+public class DnsRecord implements Serializable {
+	@Id
+	private int streamId;
+	@Id
+	private long segment;
+	@Id
+	private int number;
+	private Timestamp time;
+	private int transactionId;
+	private boolean response;
+	private int rcode;
+	private int section; // 0 question, 1 answer
+	@Column(length=256)
+	private String name;
+	private int type;
+	@Column(length=256)
+	private String data; // A, AAAA, CNAME, NS, PTR and MX answers as text, null otherwise
+	
+	private static final long serialVersionUID = 1L;
+	
+	public DnsRecord() {
+//		super();
+	}
+	
+	public DnsRecord(int streamId, long segment, int number, Timestamp time, int transactionId, boolean response,
+			int rcode, int section, String name, int type, String data) {
+		this.streamId = streamId;
+		this.segment = segment;
+		this.number = number;
+		this.time = time;
+		this.transactionId = transactionId;
+		this.response = response;
+		this.rcode = rcode;
+		this.section = section;
+		this.name = name;
+		this.type = type;
+		this.data = data;
+	}
+	
+	public int getStreamId() {
+		return this.streamId;
+	}
+	
+	public long getSegment() {
+		return this.segment;
+	}
+	
+	public int getNumber() {
+		return this.number;
+	}
+	
+	public Timestamp getTime() {
+		return this.time;
+	}
+	
+	public int getTransactionId() {
+		return this.transactionId;
+	}
+	
+	public boolean isResponse() {
+		return this.response;
+	}
+	
+	public int getRcode() {
+		return this.rcode;
+	}
+	
+	public int getSection() {
+		return this.section;
+	}
+	
+	public String getName() {
+		return this.name;
+	}
+	
+	public int getType() {
+		return this.type;
+	}
+	
+	public String getData() {
+		return this.data;
+	}
+}
@@ -0,0 +1,107 @@
+package pcap2sql.orm;
+
+import java.io.Serializable;
+import java.sql.Timestamp;
+import javax.persistence.*;
+
+/**
+ * Entity class for mapping to the table FlowSummary
+ *
+ * One record per TCP connection, UDP stream or raw IP stream, written once when it is finished. The counters are
+ * kept by the native code, so they are available without aggregating StreamSegment.
+ *
+ * @author Gyoergy Kohut <gyoergy.kohut@cs.uni-dortmund.de>
+ */
+@Entity
+public class FlowSummary implements Serializable {
+	@Id
+	private int streamId; // the Ip4Stream id of the flow, outStreamId of a Tcp4Connection
+	private int proto;
+	private int flowId; // Tcp4Connection, Udp4Stream or Ip4Stream id
+	private Integer inStreamId; // only TCP has a second direction
+	private Timestamp firstTime;
+	private Timestamp lastTime;
+	private double duration; // seconds
+	private long outPackets;
+	private long outBytes;
+	private long inPackets;
+	private long inBytes;
+	private Double meanInterArrival; // seconds, null with less than 2 packets
+	private Integer finalStatus; // TCP only, null if the connection was not closed
+	
+	private static final long serialVersionUID = 1L;
+	
+	public FlowSummary() {
+//		super();
+	}
+	
+	public FlowSummary(int streamId, int proto, int flowId, Integer inStreamId, Timestamp firstTime, Timestamp lastTime,
+			double duration, long outPackets, long outBytes, long inPackets, long inBytes, Double meanInterArrival,
+			Integer finalStatus) {
+		this.streamId = streamId;
+		this.proto = proto;
+		this.flowId = flowId;
+		this.inStreamId = inStreamId;
+		this.firstTime = firstTime;
+		this.lastTime = lastTime;
+		this.duration = duration;
+		this.outPackets = outPackets;
+		this.outBytes = outBytes;
+		this.inPackets = inPackets;
+		this.inBytes = inBytes;
+		this.meanInterArrival = meanInterArrival;
+		this.finalStatus = finalStatus;
+	}
+	
+	public int getStreamId() {
+		return this.streamId;
+	}
+	
+	public int getProto() {
+		return this.proto;
+	}
+	
+	public int getFlowId() {
+		return this.flowId;
+	}
+	
+	public Integer getInStreamId() {
+		return this.inStreamId;
+	}
+	
+	public Timestamp getFirstTime() {
+		return this.firstTime;
+	}
+	
+	public Timestamp getLastTime() {
+		return this.lastTime;
+	}
+	
+	public double getDuration() {
+		return this.duration;
+	}
+	
+	public long getOutPackets() {
+		return this.outPackets;
+	}
+	
+	public long getOutBytes() {
+		return this.outBytes;
+	}
+	
+	public long getInPackets() {
+		return this.inPackets;
+	}
+	
+	public long getInBytes() {
+		return this.inBytes;
+	}
+	
+	public Double getMeanInterArrival() {
+		return this.meanInterArrival;
+	}
+	
+	public Integer getFinalStatus() {
+		return this.finalStatus;
+	}
+}
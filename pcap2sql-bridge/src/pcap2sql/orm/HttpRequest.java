@@ -0,0 +1,90 @@
+package pcap2sql.orm;
+
+import java.io.Serializable;
+import java.sql.Timestamp;
+import javax.persistence.*;
+
+/**
+ * Entity class for mapping to the table HttpRequest
+ *
+ * One record per HTTP request found in the output stream of a TCP connection, with its request line and the Host and
+ * User-Agent headers.
+ *
+ * @author Gyoergy Kohut <gyoergy.kohut@cs.uni-dortmund.de>
+ */
+@Entity
+@IdClass(SegmentRecordId.class)
+public class HttpRequest implements Serializable {
+	@Id
+	private int streamId;
+	@Id
+	private long segment;
+	@Id
+	private int number;
+	private Timestamp time;
+	@Column(length=16)
+	private String method;
+	@Column(length=2048)
+	private String uri;
+	@Column(length=16)
+	private String version;
+	@Column(length=256)
+	private String host; // null if there is no Host header
+	@Column(length=512)
+	private String userAgent;
+	
+	private static final long serialVersionUID = 1L;
+	
+	public HttpRequest() {
+//		super();
+	}
+	
+	public HttpRequest(int streamId, long segment, int number, Timestamp time, String method, String uri,
+			String version, String host, String userAgent) {
+		this.streamId = streamId;
+		this.segment = segment;
+		this.number = number;
+		this.time = time;
+		this.method = method;
+		this.uri = uri;
+		this.version = version;
+		this.host = host;
+		this.userAgent = userAgent;
+	}
+	
+	public int getStreamId() {
+		return this.streamId;
+	}
+	
+	public long getSegment() {
+		return this.segment;
+	}
+	
+	public int getNumber() {
+		return this.number;
+	}
+	
+	public Timestamp getTime() {
+		return this.time;
+	}
+	
+	public String getMethod() {
+		return this.method;
+	}
+	
+	public String getUri() {
+		return this.uri;
+	}
+	
+	public String getVersion() {
+		return this.version;
+	}
+	
+	public String getHost() {
+		return this.host;
+	}
+	
+	public String getUserAgent() {
+		return this.userAgent;
+	}
+}
@@ -7,7 +7,6 @@ import java.io.Serializable;
 import java.sql.Timestamp;
 import java.util.LinkedList;
 import java.util.List;
-import java.util.NoSuchElementException;
 
 import javax.persistence.*;
 
@@ -121,23 +120,31 @@ public class Ip4Stream implements Serializable {
 	}
 	
 	public void addStreamSegment(int length, Timestamp time) {
-		long number;
-		long offset;
-		StreamSegment lastStreamSegment = null;
+		long number = 1;
+		long offset = 0;
 		
-		try {
-			lastStreamSegment = ((LinkedList<StreamSegment>) this.streamSegmentList).getLast();
-			number = lastStreamSegment.getNumber() + 1;
-			offset = lastStreamSegment.getOffset() + lastStreamSegment.getLength();
-		}
-		catch (NoSuchElementException e) { 
-			number = 1;
-			offset = 0;
+		/* the list is not ordered once loaded from the database, so look for the highest number */
+		for (StreamSegment streamSegment : this.streamSegmentList) {
+			if (streamSegment.getNumber() >= number) {
+				number = streamSegment.getNumber() + 1;
+				offset = streamSegment.getOffset() + streamSegment.getLength();
+			}
 		}
 		
 		this.streamSegmentList.add(new StreamSegment(number, offset, length, time));
 	}
 	
+	/**
+	 * Adds a segment whose number and offset the native side counts, so the segments already stored need not be
+	 * loaded, also after resuming from a checkpoint. The time is given as milliseconds and nanoseconds, so the native
+	 * side does not have to create a Timestamp for each packet.
+	 */
+	public void addStreamSegment(long number, long offset, int length, long millis, int nanos) {
+		Timestamp time = new Timestamp(millis);
+		time.setNanos(nanos);
+		this.streamSegmentList.add(new StreamSegment(number, offset, length, time));
+	}
+	
 	public List<StreamSegment> getStreamSegmentList() {
 		return this.streamSegmentList;
 	}
@@ -0,0 +1,39 @@
+package pcap2sql.orm;
+
+import java.io.Serializable;
+
+/**
+ * Primary key of the records extracted from the payload of a stream: the stream, the number of the StreamSegment the
+ * record starts in and the number of the record within that segment
+ *
+ * @author Gyoergy Kohut <gyoergy.kohut@cs.uni-dortmund.de>
+ */
+public class SegmentRecordId implements Serializable {
+	private int streamId;
+	private long segment;
+	private int number;
+	
+	private static final long serialVersionUID = 1L;
+	
+	public SegmentRecordId() {
+//		super();
+	}
+	
+	public SegmentRecordId(int streamId, long segment, int number) {
+		this.streamId = streamId;
+		this.segment = segment;
+		this.number = number;
+	}
+	
+	public boolean equals(Object o) {
+		if (!(o instanceof SegmentRecordId)) {
+			return false;
+		}
+		SegmentRecordId id = (SegmentRecordId) o;
+		return streamId == id.streamId && segment == id.segment && number == id.number;
+	}
+	
+	public int hashCode() {
+		return (streamId * 31 + (int) (segment ^ (segment >>> 32))) * 31 + number;
+	}
+}
@@ -119,6 +119,14 @@ public class Tcp4Connection implements Serializable {
 		this.inStream.addStreamSegment(length, time);
 	}
 	
+	public void addOutStreamSegment(long number, long offset, int length, long millis, int nanos) {
+		this.outStream.addStreamSegment(number, offset, length, millis, nanos);
+	}
+	
+	public void addInStreamSegment(long number, long offset, int length, long millis, int nanos) {
+		this.inStream.addStreamSegment(number, offset, length, millis, nanos);
+	}
+	
 	public void setOutStreamData(String path) throws IOException {
 		this.outStream.setData(path);
 	}
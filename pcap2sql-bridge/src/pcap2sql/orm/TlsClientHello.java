@@ -0,0 +1,66 @@
+package pcap2sql.orm;
+
+import java.io.Serializable;
+import java.sql.Timestamp;
+import javax.persistence.*;
+
+/**
+ * Entity class for mapping to the table TlsClientHello
+ *
+ * One record per TLS connection whose output stream starts with a ClientHello, with the server name it asks for.
+ *
+ * @author Gyoergy Kohut <gyoergy.kohut@cs.uni-dortmund.de>
+ */
+@Entity
+@IdClass(SegmentRecordId.class)
+public class TlsClientHello implements Serializable {
+	@Id
+	private int streamId;
+	@Id
+	private long segment;
+	@Id
+	private int number;
+	private Timestamp time;
+	private int version; // client_version of the ClientHello, e.g. 0x0303 for TLS 1.2 (and 1.3)
+	@Column(length=256)
+	private String serverName; // null without the server_name extension
+	
+	private static final long serialVersionUID = 1L;
+	
+	public TlsClientHello() {
+//		super();
+	}
+	
+	public TlsClientHello(int streamId, long segment, int number, Timestamp time, int version, String serverName) {
+		this.streamId = streamId;
+		this.segment = segment;
+		this.number = number;
+		this.time = time;
+		this.version = version;
+		this.serverName = serverName;
+	}
+	
+	public int getStreamId() {
+		return this.streamId;
+	}
+	
+	public long getSegment() {
+		return this.segment;
+	}
+	
+	public int getNumber() {
+		return this.number;
+	}
+	
+	public Timestamp getTime() {
+		return this.time;
+	}
+	
+	public int getVersion() {
+		return this.version;
+	}
+	
+	public String getServerName() {
+		return this.serverName;
+	}
+}
@@ -75,6 +75,10 @@ public class Udp4Stream implements Serializable {
 		this.stream.addStreamSegment(length, time);
 	}
 	
+	public void addStreamSegment(long number, long offset, int length, long millis, int nanos) {
+		this.stream.addStreamSegment(number, offset, length, millis, nanos);
+	}
+	
 	public void setLastTime(Timestamp lastTime) {
 		this.stream.setLastTime(lastTime);
 	}
@@ -0,0 +1,523 @@
+/*
+  pcapgen
+  Synthetic captures for the scale regression test of pcap2sql
+
+  Writes a deterministic pcap file (Ethernet) holding the given number of flows: TCP connections with a complete
+  handshake, data in both directions and a FIN or RST teardown, UDP streams and raw IP flows (GRE). The flows start at
+  a fixed rate, each with its own number of data packets, payload sizes and lifetime drawn uniformly around the given
+  means, and their packets are interleaved in time order. The same options always give the same file.
+
+  The payload is random lowercase letters, except for the share of TCP connections given with -H: their client sends
+  an HTTP request in each data packet, half of them ending the header lines with CRLF, the other half with a bare LF.
+
+  With -x, the statistics pcap2sql has to report for the file (see -S of pcap2sql) are written as well, as far as the
+  capture alone determines them. With -c, only the first packets are written, as if the capture was still running: the
+  file is the start of the one written without -c.
+
+  libnids only tracks a limited number of TCP connections at the same time (n_tcp_streams * 3 / 4, 780 by default), so
+  the flow rate times the mean lifetime of the TCP connections should stay well below that.
+*/
+
+
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+#define usage()								\
+  fprintf(stderr, "usage: %s -o <pcap file> [-x <statistics file>] [-n <flows>] [-r <flows per second>]\n" \
+	  "        [-p <data packets per flow>] [-l <lifetime in ms>] [-m <min payload>] [-M <max payload>]\n" \
+	  "        [-t <tcp %%>] [-u <udp %%>] [-R <reset %%>] [-H <http %%>] [-s <seed>]\n" \
+	  "        [-c <packets>]\n", argv[0]); \
+  exit(EXIT_FAILURE);
+
+#define die(s)					\
+  fprintf(stderr, "pcapgen: %s\n", s);		\
+  exit(EXIT_FAILURE);
+
+#define START_TIME 1230768000 // 2009-01-01 00:00:00 UTC
+#define RAW_PROTO 47 // GRE
+#define MAX_PAYLOAD 1460
+#define ETHER_LEN 14
+#define IP_LEN 20
+#define TCP_LEN 20
+#define UDP_LEN 8
+
+#define TH_FIN 0x01
+#define TH_SYN 0x02
+#define TH_RST 0x04
+#define TH_PUSH 0x08
+#define TH_ACK 0x10
+
+
+/* xorshift64*, each flow has a generator of its own, so a flow does not depend on the others */
+struct rng {
+  unsigned long long state;
+};
+
+void rng_seed(struct rng *r, unsigned long long seed) {
+  /* splitmix64 of the seed, the state must not be 0 */
+  seed += 0x9e3779b97f4a7c15ULL;
+  seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+  r->state = (seed ^ (seed >> 31)) | 1;
+}
+
+unsigned long long rng_next(struct rng *r) {
+  r->state ^= r->state >> 12;
+  r->state ^= r->state << 25;
+  r->state ^= r->state >> 27;
+  return r->state * 0x2545f4914f6cdd1dULL;
+}
+
+/* uniformly distributed in [min, max] */
+long rng_range(struct rng *r, long min, long max) {
+  return min + (long) (rng_next(r) % (unsigned long long) (max - min + 1));
+}
+
+
+/* flows */
+
+struct flow {
+  u_int index;
+  int proto;
+  u_int client; // host byte order
+  u_int server;
+  u_short sport;
+  u_short dport;
+  int data; // data packets
+  int reset; // TCP: closed by RST instead of FIN
+  const char *http; // TCP: the end of the lines of the HTTP requests of the client, NULL for random payload
+  int packets; // all packets
+  int sent; // packets written so far
+  long long start; // microseconds since START_TIME
+  long long lifetime;
+  long long next; // time of the next packet
+  u_int cseq; // TCP: next sequence numbers of client and server
+  u_int sseq;
+  struct rng rng;
+};
+
+/* options */
+long nflows = 1000;
+long rate = 100;
+long meanpackets = 10;
+long meanlifetime = 1000; // ms
+long minpayload = 1;
+long maxpayload = MAX_PAYLOAD;
+long tcpshare = 60;
+long udpshare = 30;
+long resetshare = 10;
+long httpshare = 0;
+unsigned long long seed = 1;
+long long limit = 0; // packets, 0 means all
+
+/* what pcap2sql has to report */
+long long packets = 0;
+long long inputbytes = 0;
+long long payloadbytes = 0;
+long tcpflows = 0;
+long udpflows = 0;
+long rawflows = 0;
+long httprequests = 0;
+long handshakes = 0;
+long peakhandshakes = 0;
+long connections = 0;
+long peakconnections = 0;
+
+FILE *out;
+u_short ipid = 0;
+
+
+void flow_init(struct flow *f, u_int index) {
+  long share;
+
+  memset(f, 0, sizeof(struct flow));
+  f->index = index;
+  rng_seed(&f->rng, seed * 0x100000001b3ULL + index);
+
+  share = rng_range(&f->rng, 0, 99);
+  if (share < tcpshare) {
+    f->proto = IPPROTO_TCP;
+  } else if (share < tcpshare + udpshare) {
+    f->proto = IPPROTO_UDP;
+  } else {
+    f->proto = RAW_PROTO;
+  }
+
+  /* one client address per flow makes the addresses, ports and protocol unique up to 2^24 * 60000 flows, the servers
+     are a few hosts on common ports */
+  f->client = 0x0a000000 + index % 0xffffff + 1; // 10.0.0.1 and on
+  f->server = 0xc0a80000 + rng_range(&f->rng, 1, 254); // 192.168.0.x
+  f->sport = 1024 + (index / 0xffffff) % 60000;
+  f->dport = f->proto == IPPROTO_UDP ? 53 : rng_range(&f->rng, 0, 1) ? 80 : 443;
+
+  if (f->proto == IPPROTO_TCP) {
+    f->data = rng_range(&f->rng, 0, 2 * meanpackets);
+    f->reset = rng_range(&f->rng, 0, 99) < resetshare;
+    f->packets = 3 + f->data + (f->reset ? 1 : 3);
+    f->cseq = (u_int) rng_next(&f->rng);
+    f->sseq = (u_int) rng_next(&f->rng);
+    tcpflows++;
+  } else {
+    f->data = f->packets = rng_range(&f->rng, 1, 2 * meanpackets - 1);
+    if (f->proto == IPPROTO_UDP) {
+      udpflows++;
+    } else {
+      rawflows++;
+    }
+  }
+
+  f->start = (long long) index * 1000000 / rate;
+  f->lifetime = rng_range(&f->rng, 0, 2 * meanlifetime) * 1000;
+  f->next = f->start;
+
+  /* drawn last and only with -H, so that the other flows and captures stay the same */
+  if (f->proto == IPPROTO_TCP && httpshare > 0 && rng_range(&f->rng, 0, 99) < httpshare) {
+    f->http = rng_range(&f->rng, 0, 1) ? "\r\n" : "\n";
+  }
+}
+
+/* the packets are spread evenly over the lifetime */
+void flow_advance(struct flow *f) {
+  f->sent++;
+  f->next = f->start + (f->packets > 1 ? f->lifetime * f->sent / (f->packets - 1) : 0);
+}
+
+
+/* heap of the active flows by the time of their next packet, ties by index */
+
+struct flow **heap = NULL;
+long heapsize = 0;
+long heapcount = 0;
+
+int heap_before(struct flow *a, struct flow *b) {
+  return a->next < b->next || (a->next == b->next && a->index < b->index);
+}
+
+void heap_push(struct flow *f) {
+  long i, parent;
+
+  if (heapcount == heapsize) {
+    heapsize = heapsize ? 2 * heapsize : 1024;
+    heap = realloc(heap, heapsize * sizeof(struct flow *));
+    if (heap == NULL) {
+      die("out of memory");
+    }
+  }
+  for (i = heapcount++; i > 0 && heap_before(f, heap[parent = (i - 1) / 2]); i = parent) {
+    heap[i] = heap[parent];
+  }
+  heap[i] = f;
+}
+
+struct flow *heap_pop() {
+  struct flow *top = heap[0];
+  struct flow *last = heap[--heapcount];
+  long i = 0, child;
+
+  while ((child = 2 * i + 1) < heapcount) {
+    if (child + 1 < heapcount && heap_before(heap[child + 1], heap[child])) {
+      child++;
+    }
+    if (!heap_before(heap[child], last)) {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = last;
+  return top;
+}
+
+
+/* packets */
+
+u_short checksum(const u_char *data, int len, u_int sum) {
+  int i;
+
+  for (i = 0; i + 1 < len; i += 2) {
+    sum += (data[i] << 8) | data[i + 1];
+  }
+  if (len & 1) {
+    sum += data[len - 1] << 8;
+  }
+  while (sum >> 16) {
+    sum = (sum & 0xffff) + (sum >> 16);
+  }
+  return ~sum & 0xffff;
+}
+
+void put16(u_char *p, u_int v) {
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+void put32(u_char *p, u_int v) {
+  p[0] = v >> 24;
+  p[1] = v >> 16;
+  p[2] = v >> 8;
+  p[3] = v;
+}
+
+/* writes the next frame of a flow, header is its TCP or UDP header (NULL for raw IP) with the checksum still 0, content
+   the payload (NULL for random letters) */
+void write_packet(struct flow *f, int fromclient, u_char *header, int headerlen, const u_char *content,
+		  int payloadlen) {
+  u_char frame[ETHER_LEN + IP_LEN + TCP_LEN + MAX_PAYLOAD];
+  u_char *ip = frame + ETHER_LEN;
+  u_char *l4 = ip + IP_LEN;
+  u_char *payload = l4 + headerlen;
+  u_int src = fromclient ? f->client : f->server;
+  u_int dst = fromclient ? f->server : f->client;
+  u_int sum, record[4];
+  int i, len = IP_LEN + headerlen + payloadlen;
+  long long ts = f->next;
+
+  /* Ethernet, locally administered addresses */
+  memcpy(frame, fromclient ? "\x02\x00\x00\x00\x00\x02" : "\x02\x00\x00\x00\x00\x01", 6);
+  memcpy(frame + 6, fromclient ? "\x02\x00\x00\x00\x00\x01" : "\x02\x00\x00\x00\x00\x02", 6);
+  put16(frame + 12, 0x0800);
+
+  memset(ip, 0, IP_LEN);
+  ip[0] = 0x45;
+  put16(ip + 2, len);
+  put16(ip + 4, ipid++);
+  ip[8] = 64;
+  ip[9] = f->proto;
+  put32(ip + 12, src);
+  put32(ip + 16, dst);
+  put16(ip + 10, checksum(ip, IP_LEN, 0));
+
+  if (header != NULL) {
+    memcpy(l4, header, headerlen);
+  }
+  if (content != NULL) {
+    memcpy(payload, content, payloadlen);
+  } else {
+    /* lowercase letters, compressible like typical payload */
+    for (i = 0; i < payloadlen; i++) {
+      payload[i] = 'a' + rng_next(&f->rng) % 26;
+    }
+  }
+  if (f->proto != RAW_PROTO) {
+    /* pseudo header */
+    sum = (src >> 16) + (src & 0xffff) + (dst >> 16) + (dst & 0xffff) + f->proto + headerlen + payloadlen;
+    put16(l4 + (f->proto == IPPROTO_TCP ? 16 : 6), checksum(l4, headerlen + payloadlen, sum));
+  }
+
+  record[0] = START_TIME + ts / 1000000;
+  record[1] = ts % 1000000;
+  record[2] = record[3] = ETHER_LEN + len;
+  if (fwrite(record, sizeof(record), 1, out) != 1 || fwrite(frame, ETHER_LEN + len, 1, out) != 1) {
+    die("failed to write the capture");
+  }
+  packets++;
+  inputbytes += sizeof(record) + ETHER_LEN + len;
+  payloadbytes += payloadlen;
+}
+
+void write_tcp(struct flow *f, int fromclient, int flags, const u_char *content, int payloadlen) {
+  u_char tcp[TCP_LEN];
+  u_int *seq = fromclient ? &f->cseq : &f->sseq;
+
+  memset(tcp, 0, TCP_LEN);
+  put16(tcp, fromclient ? f->sport : f->dport);
+  put16(tcp + 2, fromclient ? f->dport : f->sport);
+  put32(tcp + 4, *seq);
+  put32(tcp + 8, flags & TH_ACK ? (fromclient ? f->sseq : f->cseq) : 0);
+  tcp[12] = (TCP_LEN / 4) << 4;
+  tcp[13] = flags;
+  put16(tcp + 14, 65535);
+  write_packet(f, fromclient, tcp, TCP_LEN, content, payloadlen);
+  *seq += payloadlen + (flags & (TH_SYN | TH_FIN) ? 1 : 0);
+}
+
+/* TCP: handshake, data packets alternating from client and server, so that neither side runs out of window, and a
+   FIN from each side and the last ACK or a RST from the client. libnids reports the connection as established with
+   the third packet and as closed with the last one. */
+void write_next(struct flow *f) {
+  u_char udp[UDP_LEN];
+  char request[256];
+  int k = f->sent, payloadlen;
+
+  if (f->proto != IPPROTO_TCP) {
+    payloadlen = rng_range(&f->rng, minpayload, maxpayload);
+    if (f->proto == IPPROTO_UDP) {
+      put16(udp, f->sport);
+      put16(udp + 2, f->dport);
+      put16(udp + 4, UDP_LEN + payloadlen);
+      put16(udp + 6, 0);
+      write_packet(f, 1, udp, UDP_LEN, NULL, payloadlen);
+    } else {
+      write_packet(f, 1, NULL, 0, NULL, payloadlen);
+    }
+    return;
+  }
+
+  if (k == 0) {
+    write_tcp(f, 1, TH_SYN, NULL, 0);
+    if (++handshakes > peakhandshakes) {
+      peakhandshakes = handshakes;
+    }
+  } else if (k == 1) {
+    write_tcp(f, 0, TH_SYN | TH_ACK, NULL, 0);
+  } else if (k == 2) {
+    write_tcp(f, 1, TH_ACK, NULL, 0);
+    handshakes--;
+    if (++connections > peakconnections) {
+      peakconnections = connections;
+    }
+  } else if (k < 3 + f->data && f->http != NULL && (k - 3) % 2 == 0) {
+    payloadlen = snprintf(request, sizeof(request), "GET /%u/%d HTTP/1.1%sHost: www%u.example.org%s"
+			  "User-Agent: pcapgen%s%s", f->index, k, f->http, f->server & 0xff, f->http, f->http, f->http);
+    write_tcp(f, 1, TH_ACK | TH_PUSH, (u_char *) request, payloadlen);
+    httprequests++;
+  } else if (k < 3 + f->data) {
+    write_tcp(f, (k - 3) % 2 == 0, TH_ACK | TH_PUSH, NULL, rng_range(&f->rng, minpayload, maxpayload));
+  } else if (f->reset) {
+    write_tcp(f, 1, TH_RST | TH_ACK, NULL, 0);
+    connections--;
+  } else if (k == 3 + f->data) {
+    write_tcp(f, 1, TH_FIN | TH_ACK, NULL, 0);
+  } else if (k == 4 + f->data) {
+    write_tcp(f, 0, TH_FIN | TH_ACK, NULL, 0);
+  } else {
+    write_tcp(f, 1, TH_ACK, NULL, 0);
+    connections--;
+  }
+}
+
+
+void write_statistics(const char *path) {
+  FILE *file = fopen(path, "w");
+
+  if (file == NULL) {
+    die("cannot open the statistics file");
+  }
+  fprintf(file, "packets %lld\n", packets);
+  fprintf(file, "input_bytes %lld\n", inputbytes);
+  fprintf(file, "ip4streams %ld\n", 2 * tcpflows + udpflows + rawflows);
+  fprintf(file, "tcp4connections %ld\n", tcpflows);
+  fprintf(file, "udp4streams %ld\n", udpflows);
+  fprintf(file, "peak_handshakes %ld\n", peakhandshakes);
+  fprintf(file, "peak_connections %ld\n", peakconnections);
+  fprintf(file, "streamfiles %ld\n", 2 * tcpflows + udpflows + rawflows);
+  fprintf(file, "streamfile_bytes %lld\n", payloadbytes);
+  fprintf(file, "http_requests %ld\n", httprequests);
+  fclose(file);
+}
+
+int main(int argc, char *argv[]) {
+  char *outfile = NULL;
+  char *statsfile = NULL;
+  struct flow *f;
+  /* pcap file header in host byte order: version 2.4, no time zone, snaplen 65535, Ethernet */
+  struct {
+    u_int magic;
+    u_short major;
+    u_short minor;
+    int thiszone;
+    u_int sigfigs;
+    u_int snaplen;
+    u_int linktype;
+  } header = {0xa1b2c3d4, 2, 4, 0, 0, 65535, 1};
+  long started = 0;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "o:x:n:r:p:l:m:M:t:u:R:H:s:c:")) != -1) {
+    switch (opt) {
+    case 'o':
+      outfile = optarg;
+      break;
+    case 'x':
+      statsfile = optarg;
+      break;
+    case 'n':
+      nflows = atol(optarg);
+      break;
+    case 'r':
+      rate = atol(optarg);
+      break;
+    case 'p':
+      meanpackets = atol(optarg);
+      break;
+    case 'l':
+      meanlifetime = atol(optarg);
+      break;
+    case 'm':
+      minpayload = atol(optarg);
+      break;
+    case 'M':
+      maxpayload = atol(optarg);
+      break;
+    case 't':
+      tcpshare = atol(optarg);
+      break;
+    case 'u':
+      udpshare = atol(optarg);
+      break;
+    case 'R':
+      resetshare = atol(optarg);
+      break;
+    case 'H':
+      httpshare = atol(optarg);
+      break;
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'c':
+      limit = atoll(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (outfile == NULL || optind != argc || nflows < 0 || rate < 1 || meanpackets < 1 || meanlifetime < 0 ||
+      minpayload < 1 || maxpayload < minpayload || maxpayload > MAX_PAYLOAD || tcpshare < 0 || udpshare < 0 ||
+      tcpshare + udpshare > 100 || resetshare < 0 || resetshare > 100 || httpshare < 0 || httpshare > 100 ||
+      limit < 0 || (limit > 0 && statsfile != NULL)) {
+    usage();
+  }
+
+  out = fopen(outfile, "wb");
+  if (out == NULL) {
+    die("cannot open the capture file");
+  }
+  if (fwrite(&header, sizeof(header), 1, out) != 1) {
+    die("failed to write the capture");
+  }
+
+  /* flows join the heap when their start time comes, so only the active ones are held */
+  while ((started < nflows || heapcount > 0) && (limit == 0 || packets < limit)) {
+    if (started < nflows && (heapcount == 0 || (long long) started * 1000000 / rate <= heap[0]->next)) {
+      f = malloc(sizeof(struct flow));
+      if (f == NULL) {
+	die("out of memory");
+      }
+      flow_init(f, started++);
+      heap_push(f);
+      continue;
+    }
+    f = heap_pop();
+    write_next(f);
+    flow_advance(f);
+    if (f->sent < f->packets) {
+      heap_push(f);
+    } else {
+      free(f);
+    }
+  }
+
+  if (fclose(out) != 0) {
+    die("failed to write the capture");
+  }
+  if (statsfile != NULL) {
+    write_statistics(statsfile);
+  }
+  return 0;
+}
@@ -0,0 +1,182 @@
+#!/bin/sh
+#
+# Scale regression test of pcap2sql: generates the synthetic captures listed in test/scenarios with pcapgen, runs
+# pcap2sql on each of them and compares the statistics it writes with -S against test/baselines/<name>.<sink>.stats
+# within the tolerances in test/tolerances. Exits with 1 if a run fails or a statistic is out of its tolerance.
+#
+# A scenario with a number of packets in its fourth field tests resuming: pcap2sql first runs on the capture cut
+# after that many packets, then on the whole capture in the same working directory, which resumes from the
+# checkpoint of the first run. The statistics of the second run are compared.
+#
+# usage: test/regress.sh [-b] [<scenario>...]
+#   -b  write the statistics of the runs as the new baselines instead of comparing them
+#
+# Environment: SINK is h2 (default) or sqlite, CLASSPATH has to hold pcap2sql.jar for H2. The captures and working
+# directories go to TESTDIR, by default a temporary directory that is removed when all runs passed.
+
+dir=$(cd "$(dirname "$0")" && pwd)
+pcap2sql=$dir/../pcap2sql
+pcapgen=$dir/pcapgen
+sink=${SINK:-h2}
+record=0
+failed=0
+
+if [ "$1" = "-b" ]; then
+  record=1
+  shift
+fi
+
+if [ -n "$TESTDIR" ]; then
+  workdir=$TESTDIR
+  mkdir -p "$workdir" || exit 1
+else
+  workdir=$(mktemp -d "${TMPDIR:-/tmp}/pcap2sql-test.XXXXXX") || exit 1
+fi
+
+# compare <tolerances> <baseline> <statistics>, prints a line per statistic and fails if one is out of its tolerance
+# or missing
+compare() {
+  awk '
+    FILENAME == ARGV[1] {
+      if ($0 !~ /^#/ && NF == 3) {
+	order[n++] = $1
+	down[$1] = $2
+	up[$1] = $3
+      }
+      next
+    }
+    FILENAME == ARGV[2] { base[$1] = $2; next }
+    { cur[$1] = $2 }
+    END {
+      for (i = 0; i < n; i++) {
+	s = order[i]
+	if (!(s in base)) {
+	  printf "  %-24s %16s %16s  missing in the baseline, record it with -b\n", s, "-", cur[s] != "" ? cur[s] : "-"
+	  bad = 1
+	  continue
+	}
+	if (!(s in cur)) {
+	  printf "  %-24s %16s %16s  missing\n", s, base[s], "-"
+	  bad = 1
+	  continue
+	}
+	if (base[s] != 0) {
+	  change = 100 * (cur[s] - base[s]) / base[s]
+	} else {
+	  change = cur[s] > 0 ? 1e9 : cur[s] < 0 ? -1e9 : 0
+	}
+	out = (down[s] != "-" && change < -down[s]) || (up[s] != "-" && change > up[s])
+	printf "  %-24s %16s %16s %+9.1f%%%s\n", s, base[s], cur[s], change, out ? "  FAILED" : ""
+	bad = bad || out
+      }
+      exit bad
+    }' "$1" "$2" "$3"
+}
+
+# checks compare on made-up statistics, so that a tolerance applied in the wrong direction fails the test before
+# any run
+selftest() {
+  t=$workdir/selftest
+  printf 'exact 0 0\nrate 50 -\nsize - 25\n' > "$t.tolerances"
+  printf 'exact 100\nrate 1000\nsize 1000\n' > "$t.baseline"
+  for c in "0 exact=100 rate=1000 size=1000" "0 exact=100 rate=600 size=1000" "0 exact=100 rate=5000 size=1000" \
+	   "0 exact=100 rate=1000 size=1200" "0 exact=100 rate=1000 size=100" "1 exact=100 rate=400 size=1000" \
+	   "1 exact=100 rate=1000 size=1300" "1 exact=101 rate=1000 size=1000" "1 exact=99 rate=1000 size=1000" \
+	   "1 exact=100 size=1000"; do
+    set -- $c
+    expected=$1
+    shift
+    printf '%s\n' "$@" | tr '=' ' ' > "$t.stats"
+    compare "$t.tolerances" "$t.baseline" "$t.stats" > /dev/null
+    if [ $? -ne $expected ]; then
+      echo "compare self-test failed on: $*" >&2
+      return 1
+    fi
+  done
+  printf 'exact 100\nrate 1000\n' > "$t.baseline"
+  printf 'exact 100\nrate 1000\nsize 1000\n' > "$t.stats"
+  if compare "$t.tolerances" "$t.baseline" "$t.stats" > /dev/null; then
+    echo "compare self-test failed on a statistic missing in the baseline" >&2
+    return 1
+  fi
+  rm -f "$t.tolerances" "$t.baseline" "$t.stats"
+}
+
+# strips the blanks around a field of the scenarios
+trim() {
+  printf '%s\n' "$1" | sed 's/^[[:blank:]]*//; s/[[:blank:]]*$//'
+}
+
+if ! selftest; then
+  exit 1
+fi
+
+if [ ! -x "$pcap2sql" ] || [ ! -x "$pcapgen" ]; then
+  echo "build pcap2sql and test/pcapgen first (make test)" >&2
+  exit 1
+fi
+
+while IFS='|' read -r name genopts opts resume; do
+  name=$(trim "$name")
+  genopts=$(trim "$genopts")
+  opts=$(trim "$opts")
+  resume=$(trim "$resume")
+  case "$name" in
+    ''|'#'*) continue ;;
+  esac
+  if [ $# -gt 0 ] && ! echo " $* " | grep -q " $name "; then
+    continue
+  fi
+
+  baseline=$dir/baselines/$name.$sink.stats
+  echo "$name: pcapgen $genopts"
+  rm -rf "$workdir/$name" "$workdir/$name.pcap" "$workdir/$name.stats" "$workdir/$name.log"
+  mkdir "$workdir/$name"
+  if [ -n "$resume" ]; then
+    echo "$name: pcap2sql -s $sink -z none $opts on the first $resume packets"
+    if ! "$pcapgen" $genopts -c "$resume" -o "$workdir/$name.pcap" < /dev/null; then
+      echo "$name: pcapgen failed" >&2
+      failed=1
+      continue
+    fi
+    if ! "$pcap2sql" -d "$workdir/$name" -s "$sink" -z none $opts "$workdir/$name.pcap" \
+         < /dev/null 2> "$workdir/$name.log"; then
+      echo "$name: pcap2sql failed, see $workdir/$name.log" >&2
+      failed=1
+      continue
+    fi
+  fi
+  if ! "$pcapgen" $genopts -o "$workdir/$name.pcap" < /dev/null; then
+    echo "$name: pcapgen failed" >&2
+    failed=1
+    continue
+  fi
+  echo "$name: pcap2sql -s $sink -z none $opts${resume:+, resuming}"
+  if ! "$pcap2sql" -d "$workdir/$name" -s "$sink" -z none -S "$workdir/$name.stats" $opts "$workdir/$name.pcap" \
+       < /dev/null 2>> "$workdir/$name.log"; then
+    echo "$name: pcap2sql failed, see $workdir/$name.log" >&2
+    failed=1
+    continue
+  fi
+
+  if [ $record -eq 1 ]; then
+    cp "$workdir/$name.stats" "$baseline" || failed=1
+    echo "$name: baseline written to $baseline"
+  elif [ ! -f "$baseline" ]; then
+    echo "$name: no baseline $baseline, record one with -b" >&2
+    failed=1
+  elif ! compare "$dir/tolerances" "$baseline" "$workdir/$name.stats"; then
+    echo "$name: FAILED" >&2
+    failed=1
+  else
+    echo "$name: passed"
+  fi
+  rm -rf "$workdir/$name" "$workdir/$name.pcap"
+done < "$dir/scenarios"
+
+if [ $failed -eq 0 ] && [ -z "$TESTDIR" ]; then
+  rm -rf "$workdir"
+elif [ $failed -ne 0 ]; then
+  echo "the logs and statistics are in $workdir" >&2
+fi
+exit $failed